@@ -0,0 +1,504 @@
+/*
+**    This file is part of Stacy, the algebraic audio workstation.
+**    Copyright (C) 2013-2014 Mikael Bouillot
+**
+**    Stacy is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Stacy is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with Stacy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Benchmark harness
+//
+// Times every component on its own, the oscillator bank with 8, 16 and 64
+// voices, then random graphs of 64, 256, 512 and 2048 instances and a few
+// small patches with and without fusion, without touching MIDI or audio
+// devices. The results go to stdout, one tab-separated line per
+// measurement:
+//
+//   name  ns/period  heap allocations/period  real-time headroom (%)
+//
+// Stacy is built in, with its main() left out.
+
+#define STACY_NO_MAIN
+#include "stacy.c"
+
+#include <time.h>
+
+// Untimed periods run in rounds of WARMUP until a whole round goes by
+// without the pool going to the heap, or for MAX_WARMUP rounds, so that the
+// allocations counted afterwards are the steady-state ones
+#define WARMUP 100
+#define MAX_WARMUP 50
+
+int bench_periods = 2000;
+
+struct { compop op; char *name; } op_names[] =
+{
+#define OP(f) { f, #f }
+	OP(op_playback), OP(op_sampler), OP(op_varispeed), OP(op_array_1), OP(op_array_2),
+	OP(op_ctrl1), OP(op_ctrl2), OP(op_ctrl3), OP(op_ctrl4),
+	OP(op_identity), OP(op_delay), OP(op_delay_sync),
+	OP(op_elem1), OP(op_elem2), OP(op_pair), OP(op_pan),
+	OP(op_attenuate), OP(op_inverse), OP(op_add), OP(op_mult),
+	OP(op_saturate), OP(op_equalizer), OP(op_delay_line),
+	OP(op_mirror), OP(op_toggle), OP(op_logic_or), OP(op_note_wrap),
+	OP(op_game_of_life),
+	OP(op_sine_synth), OP(op_square_synth), OP(op_sawtooth_synth),
+	OP(op_bl_square_synth), OP(op_bl_sawtooth_synth),
+	OP(op_slider), OP(op_bb_slider),
+	OP(op_bb_time), OP(op_bb_rshift), OP(op_bb_not), OP(op_bb_or),
+	OP(op_bb_and), OP(op_bb_xor), OP(op_bb_onetwentyeight), OP(op_bb_audio),
+#undef OP
+	{ NULL, NULL }
+};
+
+// Input candidates, tried in this order for every argument. Graphs start
+// with a source of each of the first NUM_SOURCES kinds.
+#define NUM_KINDS 5
+#define NUM_SOURCES 3
+sig_type kinds[NUM_KINDS] = { SIG_AUDIO, SIG_UI, SIG_BYTEBEAT, SIG_PAIR, SIG_CONTROL };
+sig_head *samples[NUM_KINDS];
+
+// What each component was found to accept and return
+typedef struct
+{
+	component *c;
+	char name[32];
+	int ok;
+	sig_type in[MAX_COMP_ARGS];
+	sig_type out;
+} comp_info;
+
+comp_info infos[8*8];
+int num_infos = 0;
+
+double now (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+void report (char *name, double ns, double allocs)
+{
+	double budget;
+
+	budget = 1e9 * psize / srate;
+	printf ("%s\t%.0f\t%.3f\t%.1f\n", name, ns, allocs, 100 * (1 - ns / budget));
+	fflush (stdout);
+}
+
+//==============================================================================
+// Realistic inputs: a chord on the pads, a tone, a bytebeat clock, a slide
+
+void make_samples (void)
+{
+	sig_head *s, *e[2];
+	sig_t_audio audio;
+	sig_t_ui ui;
+	sig_t_bytebeat bb;
+	void *state;
+	int size, a;
+
+	size = sizeof (sig_head) + psize * sizeof (sig_audio);
+	s = sig_alloc (size);
+	s->type = SIG_AUDIO;
+	s->size = size;
+	s->frames = psize;
+	audio = (void *) (s + 1);
+	for (a = 0; a < psize; a++)
+		audio[a] = 0.5 * sin (2 * M_PI * 220 * a / srate);
+	samples[0] = s;
+
+	ui = UI_BIT (2, 3) | UI_BIT (4, 5) | UI_BIT (5, 1);
+	samples[1] = sig_new_ui (ui);
+
+	size = sizeof (sig_head) + bb_size * sizeof (int);
+	s = sig_alloc (size);
+	s->type = SIG_BYTEBEAT;
+	s->size = size;
+	s->frames = bb_size;
+	bb = (void *) (s + 1);
+	for (a = 0; a < bb_size; a++)
+		bb[a] = 12345 + a;
+	samples[2] = s;
+
+	e[0] = samples[0];
+	e[1] = samples[1];
+	state = NULL;
+	samples[3] = op_pair (e, &state);
+
+	samples[4] = sig_new_control (0.1, 0.2);
+
+	// The same chord for the components reading the pads directly
+	input[3][4] = input[5][6] = input[6][2] = 1;
+	input[12][4] = input[14][6] = input[15][2] = 1;
+}
+
+//==============================================================================
+// Components in isolation
+
+// Find the first combination of inputs the component doesn't reject
+void probe (comp_info *ci)
+{
+	sig_head *in[MAX_COMP_ARGS], *out;
+	int pick[MAX_COMP_ARGS];
+	int n, a, combos, k, t;
+	void *state;
+
+	n = ci->c->num_inputs;
+	combos = 1;
+	for (a = 0; a < n; a++)
+		combos *= NUM_KINDS;
+
+	for (k = 0; k < combos; k++)
+	{
+		for (a = 0; a < n; a++)
+		{
+			pick[a] = (k / (int) pow (NUM_KINDS, n - 1 - a)) % NUM_KINDS;
+			in[a] = samples[pick[a]];
+		}
+
+		// Delays only produce something once they're full
+		state = NULL;
+		for (t = 0; t <= DELAY; t++)
+		{
+			out = ci->c->op (in, &state);
+			if (out->type != SIG_ERROR)
+				break;
+		}
+
+		if (out->type != SIG_ERROR)
+		{
+			ci->ok = 1;
+			ci->out = out->type;
+			for (a = 0; a < n; a++)
+				ci->in[a] = kinds[pick[a]];
+			sig_unref (out);
+			return;
+		}
+	}
+
+	ci->ok = 0;
+}
+
+void bench_component (comp_info *ci)
+{
+	sig_head *in[MAX_COMP_ARGS];
+	unsigned long allocs;
+	double start;
+	void *state;
+	int a, k, r;
+
+	for (a = 0; a < ci->c->num_inputs; a++)
+		for (k = 0; k < NUM_KINDS; k++)
+			if (kinds[k] == ci->in[a])
+				in[a] = samples[k];
+
+	state = NULL;
+	for (r = 0; r < MAX_WARMUP; r++)
+	{
+		allocs = pool_heap_allocs;
+		for (a = 0; a < WARMUP; a++)
+			sig_unref (ci->c->op (in, &state));
+		if (pool_heap_allocs == allocs)
+			break;
+	}
+
+	allocs = pool_heap_allocs;
+	start = now();
+	for (a = 0; a < bench_periods; a++)
+		sig_unref (ci->c->op (in, &state));
+
+	report (ci->name, (now() - start) / bench_periods,
+		(double) (pool_heap_allocs - allocs) / bench_periods);
+}
+
+void list_components (void)
+{
+	comp_info *ci;
+	int x, y, a;
+
+	for (y=0; y<8; y++) for (x=0; x<8; x++)
+	{
+		if (comp_table[x][y].empty)
+			continue;
+
+		ci = &infos[num_infos++];
+		ci->c = &comp_table[x][y];
+		sprintf (ci->name, "comp_%d_%d", x, y);
+		for (a = 0; op_names[a].op; a++)
+			if (op_names[a].op == ci->c->op)
+				strcpy (ci->name, op_names[a].name);
+
+		probe (ci);
+		if (! ci->ok)
+			fprintf (stderr, "%s: no accepted inputs, skipped\n", ci->name);
+	}
+}
+
+//==============================================================================
+// Oscillator bank, as the naive synths drive it
+
+void bench_osc (int voices, int wave)
+{
+	float out[MAX_PSIZE], inc[MAX_PSIZE];
+	float phase[64], freq[64];
+	char name[32];
+	double start;
+	int a;
+
+	for (a = 0; a < voices; a++)
+	{
+		phase[a] = 0;
+		freq[a] = 110.0f * (a + 1);
+	}
+	for (a = 0; a < psize; a++)
+		inc[a] = 1.0f / srate;
+
+	for (a = 0; a < WARMUP; a++)
+	{
+		bzero (out, psize * sizeof (float));
+		vec_osc (out, phase, freq, voices, inc, psize, wave);
+	}
+
+	start = now();
+	for (a = 0; a < bench_periods; a++)
+	{
+		bzero (out, psize * sizeof (float));
+		vec_osc (out, phase, freq, voices, inc, psize, wave);
+	}
+
+	sprintf (name, "osc_%s_%d", wave == OSC_SINE ? "sine" : "saw", voices);
+	report (name, (now() - start) / bench_periods, 0);
+}
+
+//==============================================================================
+// Whole graphs
+
+void warm_up (void)
+{
+	unsigned long allocs;
+	int a, r;
+
+	for (r = 0; r < MAX_WARMUP; r++)
+	{
+		allocs = pool_heap_allocs;
+		for (a = 0; a < WARMUP; a++)
+			compute_signals();
+		if (pool_heap_allocs == allocs)
+			break;
+	}
+}
+
+// Random DAG: every argument reads an earlier instance of the right type,
+// the first instances being sources of each type.
+void build_graph (int size)
+{
+	coord *by_type[SIG_PAIR+1];
+	int count[SIG_PAIR+1];
+	instance inst;
+	comp_info *ci;
+	int i, a, k, tries;
+
+	inst_clear();
+	bzero (count, sizeof (count));
+	bzero (&inst, sizeof (inst));
+	for (k = 0; k <= SIG_PAIR; k++)
+		by_type[k] = malloc (size * sizeof (coord));
+	srand (size);
+
+	for (i = 0; i < size; i++)
+	{
+		for (tries = 0; ; tries++)
+		{
+			assert (tries < 100000);
+			ci = &infos[rand() % num_infos];
+			if (! ci->ok)
+				continue;
+			if (i < NUM_SOURCES && (ci->c->num_inputs != 0 || ci->out != kinds[i]))
+				continue;
+
+			for (a = 0; a < ci->c->num_inputs; a++)
+				if (count[ci->in[a]] == 0)
+					break;
+			if (a == ci->c->num_inputs)
+				break;
+		}
+
+		inst.c = *ci->c;
+		for (a = 0; a < ci->c->num_inputs; a++)
+		{
+			k = ci->in[a];
+			inst.inputs[a] = by_type[k][rand() % count[k]];
+		}
+
+		inst_put ((coord) {i % 8, i / 8}, &inst);
+		by_type[ci->out][count[ci->out]++] = (coord) {i % 8, i / 8};
+	}
+
+	for (k = 0; k <= SIG_PAIR; k++)
+		free (by_type[k]);
+}
+
+void bench_graph (int size)
+{
+	unsigned long allocs;
+	char name[32];
+	double start;
+	int a;
+
+	build_graph (size);
+
+	warm_up();
+
+	allocs = pool_heap_allocs;
+	start = now();
+	for (a = 0; a < bench_periods; a++)
+		compute_signals();
+
+	sprintf (name, "graph_%d", size);
+	report (name, (now() - start) / bench_periods,
+		(double) (pool_heap_allocs - allocs) / bench_periods);
+}
+
+// Small fixed patches, from (1,0) onwards, with fusion on or off
+typedef struct
+{
+	int x, y;	// Component
+	coord in[2];
+} patch_inst;
+
+// (t>>1)|(t&128) into op_bb_audio
+patch_inst bytebeat_patch[] =
+{
+	{ 0, 7, {} },			// (1,0): t
+	{ 1, 7, {{1, 0}} },		// (2,0): t>>1
+	{ 6, 7, {} },			// (3,0): 128
+	{ 4, 7, {{1, 0}, {3, 0}} },	// (4,0): t&128
+	{ 3, 7, {{2, 0}, {4, 0}} },	// (5,0): (t>>1)|(t&128)
+	{ 7, 7, {{5, 0}} },		// (6,0): audio
+	{ -1 }
+};
+
+// playback -> attenuate -> inverse -> saturate -> add (with playback)
+patch_inst chain_patch[] =
+{
+	{ 0, 0, {} },			// (1,0): playback
+	{ 0, 3, {{1, 0}} },		// (2,0): attenuate
+	{ 1, 3, {{2, 0}} },		// (3,0): inverse
+	{ 6, 3, {{3, 0}} },		// (4,0): saturate
+	{ 3, 3, {{4, 0}, {1, 0}} },	// (5,0): add
+	{ -1 }
+};
+
+void bench_patch (char *name, patch_inst *patch, int fused)
+{
+	unsigned long allocs;
+	instance inst;
+	char full[32];
+	double start;
+	int a;
+
+	inst_clear();
+	bb_fusion = ew_fusion = fused;
+
+	bzero (&inst, sizeof (inst));
+	for (a = 0; patch[a].x >= 0; a++)
+	{
+		inst.c = comp_table[patch[a].x][patch[a].y];
+		inst.inputs[0] = patch[a].in[0];
+		inst.inputs[1] = patch[a].in[1];
+		inst_put ((coord) {a + 1, 0}, &inst);
+	}
+
+	warm_up();
+
+	allocs = pool_heap_allocs;
+	start = now();
+	for (a = 0; a < bench_periods; a++)
+		compute_signals();
+
+	sprintf (full, "%s_%s", name, fused ? "fused" : "split");
+	report (full, (now() - start) / bench_periods,
+		(double) (pool_heap_allocs - allocs) / bench_periods);
+
+	bb_fusion = ew_fusion = 1;
+}
+
+//==============================================================================
+
+int main (int argc, char *argv[])
+{
+	int opt, workers, a;
+
+	workers = 1;
+
+	while ((opt = getopt (argc, argv, "j:n:p:b:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'j':
+				workers = atoi (optarg);
+				break;
+			case 'n':
+				bench_periods = atoi (optarg);
+				break;
+			case 'p':
+				set_period_size (atoi (optarg));
+				break;
+			case 'b':
+				bb_rate = atoi (optarg);
+				break;
+			default:
+				fprintf (stderr, "Usage: %s [-j workers] [-n periods] [-p frames] [-b bytebeat rate]\n", argv[0]);
+				exit (1);
+		}
+	}
+
+	set_bb_sizes();
+	playback_init();
+	osc_init (srate);
+	vec_init();
+	workers_init (workers);
+	comp_init();
+
+	fprintf (stderr, "Stacy %s benchmark, %s kernels, %d worker(s), %d periods of %d frames\n",
+		VERSION, vec_isa, workers, bench_periods, psize);
+
+	make_samples();
+	list_components();
+
+	printf ("# name\tns_per_period\tallocs_per_period\theadroom_pct\n");
+
+	for (a = 0; a < num_infos; a++)
+		if (infos[a].ok)
+			bench_component (&infos[a]);
+
+	bench_osc (8, OSC_SINE);
+	bench_osc (16, OSC_SINE);
+	bench_osc (64, OSC_SINE);
+	bench_osc (64, OSC_SAWTOOTH);
+
+	bench_graph (64);
+	bench_graph (256);
+	bench_graph (512);
+	bench_graph (2048);
+
+	bench_patch ("bytebeat", bytebeat_patch, 0);
+	bench_patch ("bytebeat", bytebeat_patch, 1);
+	bench_patch ("chain", chain_patch, 0);
+	bench_patch ("chain", chain_patch, 1);
+
+	return 0;
+}
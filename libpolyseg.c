@@ -20,15 +20,17 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
 #include "libpolyseg.h"
 
 
 /********** Anti-aliasing filter **********/
 
 // TODO: test integration quality
-#define KUNIT 256
-#define KSIZE 32
+#define KUNIT OSC_SINC_PHASES
+#define KSIZE OSC_SINC_HALF
 #define KBUFSIZE (KUNIT*KSIZE+1)
+#define KCUTOFF OSC_CUTOFF
 
 double k0 [KBUFSIZE];
 double k1 [KBUFSIZE];
@@ -83,7 +85,7 @@ void make_kernel (void)
 	
 	for (a=0; a<KBUFSIZE; a++)
 	{
-		fa = (double) a / KUNIT * M_PI * 0.83;
+		fa = (double) a / KUNIT * M_PI * KCUTOFF;
 		if (fa == 0)
 			k0[a] = 1;
 		else
@@ -94,6 +96,74 @@ void make_kernel (void)
 	integrate (k2, k1);
 }
 
+// The integrated kernels, sliced by sub-sample phase for rendering. Row p
+// holds the 2*KSIZE+1 taps seen, from the oldest sample to the newest, by
+// the samples around a boundary that lies p/KUNIT sample past a sample
+// instant. The tables are mirrored and zeroed outside the window so the
+// inner loop runs branch-free.
+#define KTAPS (2*KSIZE+1)
+#define BLOCK 64
+
+float kt1 [KUNIT][KTAPS];
+float kt2 [KUNIT][KTAPS];
+
+void make_tables (void)
+{
+	int p, j, x;
+	
+	for (p=0; p<KUNIT; p++)
+	{
+		for (j=0; j<KTAPS; j++)
+		{
+			x = (KSIZE - j) * KUNIT + p;
+			if (x <= -KSIZE*KUNIT || x > KSIZE*KUNIT)
+			{
+				kt1[p][j] = 0;
+				kt2[p][j] = 0;
+			}
+			else
+			{
+				kt1[p][j] = gk1 (x);
+				kt2[p][j] = gk2 (x);
+			}
+		}
+	}
+}
+
+// The kernel itself, sliced the same way for interpolating between samples,
+// and whole with a unit gain for the resamplers that stretch it
+float ksinc [KUNIT][2*KSIZE];
+float kside [KBUFSIZE+KUNIT];
+
+void make_sinc (void)
+{
+	int p, j;
+	double sum;
+	
+	for (p=0; p<KUNIT; p++)
+	{
+		sum = 0;
+		for (j=0; j<2*KSIZE; j++)
+			sum += k0[abs ((j - KSIZE + 1) * KUNIT - p)];
+		
+		for (j=0; j<2*KSIZE; j++)
+			ksinc[p][j] = k0[abs ((j - KSIZE + 1) * KUNIT - p)] / sum;
+	}
+	
+	for (j=0; j<KBUFSIZE+KUNIT; j++)
+		kside[j] = j < KBUFSIZE ? k0[j] * KCUTOFF : 0;
+}
+
+const float *osc_sinc_row (int phase)
+{
+	return ksinc[phase];
+}
+
+const float *osc_sinc_table (void)
+{
+	return kside;
+}
+
 /******************************************/
 
 double sample_rate;
@@ -110,6 +180,8 @@ void osc_init (int sr)
 	oversampling_ratio = 1.0 / sr;
 	
 	make_kernel();
+	make_tables();
+	make_sinc();
 }
 
 osc_stream *osc_new_stream (void)
@@ -119,89 +191,429 @@ osc_stream *osc_new_stream (void)
 	s = malloc (sizeof (osc_stream));
 	s->stime = 0;
 	
-	s->state.time = 0;
+	s->state.time = -((double) KSIZE / sample_rate);
 	s->state.p0 = 0;
 	s->state.p1 = 0;
 	s->state.p2 = 0;
 	
-	s->qin = s->qout = 0;
+	s->in.chunk = malloc (sizeof (osc_chunk));
+	s->in.chunk->next = NULL;
+	s->in.chunk->seg[0] = s->state;
+	s->in.n = 0;
 	
-	s->queue[0].time = -((double) KSIZE / sample_rate);
-	s->queue[0].p0 = 0;
-	s->queue[0].p1 = 0;
-	s->queue[0].p2 = 0;
+	s->out = s->in;
+	s->qin = 0;
+	s->spare = NULL;
 	
 	return s;
 }
 
+// The chunks still queued run from the renderer's cursor to the producer's
+void osc_free_stream (osc_stream *s)
+{
+	osc_chunk *c, *next;
+	
+	for (c = s->out.chunk; c; c = next)
+	{
+		next = c->next;
+		free (c);
+	}
+	
+	free (s->spare);
+	free (s);
+}
+
 osc_clock osc_time_dependency (osc_stream *s, int num_samples)
 {
-	osc_clock ret;
+	osc_clock ret, now;
 	
 	assert (sample_rate != 0);
+	__atomic_load (&s->stime, &now, __ATOMIC_RELAXED);
 	ret =
-		s->stime
+		now
 		+ (osc_clock) (num_samples + KSIZE) / sample_rate;
 	return ret;
 }
 
+osc_segdef *cursor_seg (osc_cursor *c)
+{
+	return &c->chunk->seg[c->n % QCHUNK];
+}
+
+void cursor_next (osc_cursor *c)
+{
+	c->n++;
+	if (c->n % QCHUNK == 0)
+		c->chunk = c->chunk->next;
+}
+
 void osc_update_stream (osc_stream *s, osc_segdef seg)
 {
-	assert (seg.time >= s->queue[s->qin].time);
+	osc_chunk *c;
 	
-	s->qin = (s->qin + 1) & QMASK;
-	s->queue[s->qin] = seg;
+	assert (seg.time >= s->state.time);
+	
+	// Link a new chunk before the segment that needs it is published
+	if ((s->in.n + 1) % QCHUNK == 0)
+	{
+		c = __atomic_exchange_n (&s->spare, NULL, __ATOMIC_ACQUIRE);
+		if (! c)
+			c = malloc (sizeof (osc_chunk));
+		c->next = NULL;
+		s->in.chunk->next = c;
+	}
+	
+	cursor_next (&s->in);
+	*cursor_seg (&s->in) = seg;
+	s->state = seg;
+	
+	__atomic_store_n (&s->qin, s->in.n, __ATOMIC_RELEASE);
+}
+
+// Forget the oldest segment, retiring its chunk once it is empty. Only
+// one chunk is kept aside for the producer; the others are freed.
+void stream_drop (osc_stream *s)
+{
+	osc_chunk *old;
+	
+	old = s->out.chunk;
+	cursor_next (&s->out);
+	if (s->out.chunk == old)
+		return;
+	
+	if (__atomic_load_n (&s->spare, __ATOMIC_RELAXED) == NULL)
+		__atomic_store_n (&s->spare, old, __ATOMIC_RELEASE);
+	else
+		free (old);
+}
+
+// Position of a segment boundary relative to the stream clock, in
+// kernel units (1/KUNIT sample).
+int boundary_pos (osc_segdef *seg, osc_clock stime)
+{
+	return lrint ((seg->time - stime) * sample_rate * KUNIT);
+}
+
+// Position of the boundary that ends the segment under the cursor, or
+// INT_MAX if no newer segment has been queued.
+int next_boundary (osc_cursor c, long last, osc_clock stime)
+{
+	if (c.n == last)
+		return INT_MAX;
+	cursor_next (&c);
+	return boundary_pos (cursor_seg (&c), stime);
 }
 
 void osc_render_stream (osc_stream *s, int samples, osc_sample *buffer)
 {
-	int sp;
-	int seg;
-	osc_clock x1, x2, x1k, x2k;
-	double res, fx1, fx2, fa;
+	float acc [BLOCK + 4*KSIZE];
+	int sp, len, j, pos, botpos, toppos, p, q;
+	osc_cursor seg, bot, top;
+	osc_segdef *prev, *cur;
+	long last;
+	float jump, bend;
+	double c1, c2, t, stime, period, window, fbot, ftop;
+	
+	// Both kernels are flat past the window edges
+	c1 = k1[KBUFSIZE-1];
+	c2 = k2[KBUFSIZE-1];
+	
+	period = 1.0 / sample_rate;
+	window = KSIZE * period;
 	
-	for (sp=0; sp<samples; sp++)
+	last = __atomic_load_n (&s->qin, __ATOMIC_ACQUIRE);
+	stime = s->stime;
+	
+	for (; samples > 0; samples -= len, buffer += len)
 	{
-		s->stime += 1.0 / sample_rate;
-		x2 = s->stime + (double) KSIZE / sample_rate;
-		seg = s->qin;
-		while (s->queue[seg].time > x2)
-		{
-			seg = (seg - 1) & QMASK;
-			assert (seg != s->qin);
-		}
-		x1 = s->queue[seg].time;
-		assert (x1 <= x2);
+		len = samples < BLOCK ? samples : BLOCK;
 		
-		res = 0;
+		// Drop the segments that ended before the first window of the block
+		while (next_boundary (s->out, last, stime) <= (1-KSIZE) * KUNIT)
+			stream_drop (s);
 		
-		while (x1 > s->stime - (double) KSIZE / sample_rate)
+		// Each boundary between two segments adds a step (the jump in
+		// value) and a ramp (the change of slope) to the samples it is in
+		// sight of. acc[sp+2*KSIZE] accumulates sample sp of the block.
+		for (j=0; j<len+4*KSIZE; j++)
+			acc[j] = 0;
+		
+		for (seg = s->out; seg.n != last; )
 		{
-			x1k = (x1 - s->stime) * sample_rate * KUNIT;
-			x2k = (x2 - s->stime) * sample_rate * KUNIT;
+			prev = cursor_seg (&seg);
+			cursor_next (&seg);
+			cur = cursor_seg (&seg);
 			
-			fx1 = s->queue[seg].p0;
-			fx2 = s->queue[seg].p1 * (x2-x1) + s->queue[seg].p0;
-			fa = BUG1*s->queue[seg].p1;
+			pos = boundary_pos (cur, stime);
+			if (pos > (len+KSIZE) * KUNIT)
+				break;
 			
-			res += fx2*gk1(x2k) - fx1*gk1(x1k) - fa*gk2(x2k) + fa*gk2(x1k);
+			jump = cur->p0 - (prev->p1 * (cur->time - prev->time) + prev->p0);
+			bend = BUG1 * (cur->p1 - prev->p1);
 			
-			x2 = x1;
-			seg = (seg - 1) & QMASK;
-			assert (seg != s->qin);
-			x1 = s->queue[seg].time;
+			p = pos & (KUNIT-1);
+			q = (pos - p) / KUNIT;
+			for (j=0; j<KTAPS; j++)
+				acc[q+KSIZE-1+j] += bend * kt2[p][j] - jump * kt1[p][j];
 		}
 		
-		x1 = s->stime - (double) KSIZE / sample_rate;
-		x1k = (x1 - s->stime) * sample_rate * KUNIT;
-		x2k = (x2 - s->stime) * sample_rate * KUNIT;
-
-		fx1 = s->queue[seg].p1 * (x1 - s->queue[seg].time) + s->queue[seg].p0;
-		fx2 = s->queue[seg].p1 * (x2 - s->queue[seg].time) + s->queue[seg].p0;
-		fa = BUG1*s->queue[seg].p1;
+		// Close every window with the segments that cross its edges
+		bot = top = s->out;
+		botpos = toppos = next_boundary (s->out, last, stime);
+		for (sp=0; sp<len; sp++)
+		{
+			while (toppos <= (sp+1+KSIZE) * KUNIT)
+			{
+				cursor_next (&top);
+				toppos = next_boundary (top, last, stime);
+			}
+			while (botpos <= (sp+1-KSIZE) * KUNIT)
+			{
+				cursor_next (&bot);
+				botpos = next_boundary (bot, last, stime);
+			}
+			
+			prev = cursor_seg (&bot);
+			cur = cursor_seg (&top);
+			t = stime + (sp+1) * period;
+			ftop = cur->p1 * (t + window - cur->time) + cur->p0;
+			fbot = prev->p1 * (t - window - prev->time) + prev->p0;
+			
+			buffer[sp] = acc[sp+2*KSIZE]
+				+ c1 * (ftop + fbot)
+				- c2 * BUG1 * (cur->p1 - prev->p1);
+		}
 		
-		res += fx2*gk1(x2k) - fx1*gk1(x1k) - fa*gk2(x2k) + fa*gk2(x1k);
+		stime += len * period;
+		__atomic_store (&s->stime, &stime, __ATOMIC_RELAXED);
+	}
+}
+
+/********** Polyphony **********/
+
+// Each voice schedules its own edges. The voices wait in a min-heap
+// ordered by the time of their next edge, so emitting an edge costs
+// O(log voices), and all of them are summed into a single stream.
 
-		buffer[sp] = res;
+osc_poly *osc_new_poly (void)
+{
+	osc_poly *p;
+	int a;
+	
+	p = malloc (sizeof (osc_poly));
+	p->stream = osc_new_stream();
+	p->seg = p->stream->state;
+	p->changed = 0;
+	p->num_active = 0;
+	
+	for (a=0; a<OSC_VOICES; a++)
+		p->voice[a].slot = -1;
+	
+	return p;
+}
+
+void osc_free_poly (osc_poly *p)
+{
+	osc_free_stream (p->stream);
+	free (p);
+}
+
+void heap_place (osc_poly *p, int slot, int v)
+{
+	p->heap[slot] = v;
+	p->voice[v].slot = slot;
+}
+
+void heap_up (osc_poly *p, int slot)
+{
+	int v, parent;
+	
+	v = p->heap[slot];
+	while (slot > 0)
+	{
+		parent = (slot - 1) / 2;
+		if (p->voice[p->heap[parent]].next <= p->voice[v].next)
+			break;
+		heap_place (p, slot, p->heap[parent]);
+		slot = parent;
+	}
+	heap_place (p, slot, v);
+}
+
+void heap_down (osc_poly *p, int slot)
+{
+	int v, child;
+	
+	v = p->heap[slot];
+	while ((child = slot * 2 + 1) < p->num_active)
+	{
+		if (child + 1 < p->num_active
+			&& p->voice[p->heap[child+1]].next < p->voice[p->heap[child]].next)
+			child++;
+		if (p->voice[v].next <= p->voice[p->heap[child]].next)
+			break;
+		heap_place (p, slot, p->heap[child]);
+		slot = child;
+	}
+	heap_place (p, slot, v);
+}
+
+void heap_remove (osc_poly *p, int v)
+{
+	int slot;
+	
+	slot = p->voice[v].slot;
+	p->voice[v].slot = -1;
+	p->num_active--;
+	if (slot == p->num_active)
+		return;
+	
+	heap_place (p, slot, p->heap[p->num_active]);
+	heap_up (p, slot);
+	heap_down (p, p->voice[p->heap[slot]].slot);
+}
+
+// Note that the sum must be rebuilt from the voices at this time
+void poly_changed (osc_poly *p, osc_clock time)
+{
+	assert (time >= p->seg.time);
+	p->changed = 1;
+	p->change_time = time;
+}
+
+void voice_start (osc_poly *p, int v, osc_clock time, osc_voice *def)
+{
+	assert (v >= 0 && v < OSC_VOICES);
+	
+	if (p->voice[v].slot >= 0)
+		heap_remove (p, v);
+	
+	def->ref = time;
+	def->next = ceil (time / def->period) * def->period;
+	if (def->next <= time)
+		def->next += def->period;
+	
+	p->voice[v] = *def;
+	heap_place (p, p->num_active, v);
+	p->num_active++;
+	heap_up (p, p->voice[v].slot);
+	
+	poly_changed (p, time);
+}
+
+// The voices are phase-locked to absolute time, so that the same note
+// started at different times sounds the same.
+void osc_voice_square (osc_poly *p, int v, osc_clock time, double freq, double amp)
+{
+	osc_voice def;
+	double phase;
+	
+	phase = time * freq - floor (time * freq);
+	def.level = phase < 0.5 ? amp : -amp;
+	def.slope = 0;
+	def.jump = -2 * def.level;
+	def.alternate = 1;
+	def.period = 0.5 / freq;
+	
+	voice_start (p, v, time, &def);
+}
+
+void osc_voice_sawtooth (osc_poly *p, int v, osc_clock time, double freq, double amp)
+{
+	osc_voice def;
+	double phase;
+	
+	phase = time * freq - floor (time * freq);
+	def.level = amp * (phase * 2 - 1);
+	def.slope = amp * 2 * freq;
+	def.jump = -2 * amp;
+	def.alternate = 0;
+	def.period = 1.0 / freq;
+	
+	voice_start (p, v, time, &def);
+}
+
+void osc_voice_stop (osc_poly *p, int v, osc_clock time)
+{
+	assert (v >= 0 && v < OSC_VOICES);
+	
+	if (p->voice[v].slot < 0)
+		return;
+	
+	heap_remove (p, v);
+	poly_changed (p, time);
+}
+
+// Scale the frequency of every voice, keeping their phases
+void osc_poly_retune (osc_poly *p, osc_clock time, double ratio)
+{
+	osc_voice *v;
+	int a;
+	
+	// A uniform scaling keeps the heap ordered
+	for (a=0; a<p->num_active; a++)
+	{
+		v = &p->voice[p->heap[a]];
+		v->level += v->slope * (time - v->ref);
+		v->ref = time;
+		v->slope *= ratio;
+		v->period /= ratio;
+		v->next = time + (v->next - time) / ratio;
+	}
+	
+	poly_changed (p, time);
+}
+
+// Rebuild the sum from scratch, so that rounding errors from the edges
+// never outlive a change of voices: no voices is exactly silence.
+void poly_resum (osc_poly *p, osc_clock time)
+{
+	osc_voice *v;
+	int a;
+	
+	p->seg = (osc_segdef) {time, 0, 0, 0};
+	for (a=0; a<p->num_active; a++)
+	{
+		v = &p->voice[p->heap[a]];
+		p->seg.p0 += v->level + v->slope * (time - v->ref);
+		p->seg.p1 += v->slope;
+	}
+	
+	osc_update_stream (p->stream, p->seg);
+}
+
+// Queue every edge that happens before the deadline
+void osc_poly_advance (osc_poly *p, osc_clock deadline)
+{
+	osc_voice *v;
+	osc_clock time;
+	
+	if (p->changed)
+	{
+		poly_resum (p, p->change_time);
+		p->changed = 0;
+	}
+	
+	while (p->num_active > 0 && p->voice[p->heap[0]].next < deadline)
+	{
+		time = p->voice[p->heap[0]].next;
+		p->seg.p0 += p->seg.p1 * (time - p->seg.time);
+		p->seg.time = time;
+		
+		// Simultaneous edges go into the same segment
+		do
+		{
+			v = &p->voice[p->heap[0]];
+			v->level += v->slope * (time - v->ref) + v->jump;
+			v->ref = time;
+			p->seg.p0 += v->jump;
+			if (v->alternate)
+				v->jump = -v->jump;
+			v->next += v->period;
+			heap_down (p, 0);
+		}
+		while (p->voice[p->heap[0]].next == time);
+		
+		osc_update_stream (p->stream, p->seg);
 	}
 }
@@ -33,22 +33,101 @@ typedef struct
 }
 osc_segdef;
 
-#define QSIZE 256
-#define QMASK 0xff
+/* Segments are queued in a linked list of chunks. One thread may queue
+   segments while another renders them; chunks that fall behind the
+   kernel window are handed back to the producer for reuse. */
+
+#define QCHUNK 256
+
+typedef struct osc_chunk
+{
+	osc_segdef seg[QCHUNK];
+	struct osc_chunk *next;
+}
+osc_chunk;
 
 typedef struct
 {
+	osc_chunk *chunk;
+	long n;              /* Sequence number of the segment            */
+}
+osc_cursor;
+
+typedef struct
+{
+	/* Renderer side */
 	osc_clock stime;
-	osc_segdef state;
-	osc_segdef queue[QSIZE];
-	int qin, qout;
+	osc_cursor out;      /* Oldest segment still in the window        */
+	
+	/* Producer side */
+	osc_segdef state;    /* Newest segment queued                     */
+	osc_cursor in;       /* Where it is stored                        */
+	
+	long qin;            /* Sequence number of the newest segment     */
+	osc_chunk *spare;    /* Retired chunk, waiting to be reused       */
 }
 osc_stream;
 
+#define OSC_VOICES 128
+
+typedef struct
+{
+	osc_clock ref;       /* Time of the last edge                 */
+	osc_funcparm level;  /* Value at ref                          */
+	osc_funcparm slope;  /* Speed between edges                   */
+	osc_funcparm jump;   /* Step taken at the next edge           */
+	int alternate;       /* Jump changes sign after every edge    */
+	osc_clock period;    /* Time between edges                    */
+	osc_clock next;      /* Time of the next edge                 */
+	int slot;            /* Position in the edge heap, -1 if idle */
+}
+osc_voice;
+
+typedef struct
+{
+	osc_stream *stream;  /* Sum of all the voices                 */
+	osc_segdef seg;      /* Last segment queued on the stream     */
+	int changed;         /* Voices were changed at change_time    */
+	osc_clock change_time;
+	osc_voice voice[OSC_VOICES];
+	int heap[OSC_VOICES];
+	int num_active;
+}
+osc_poly;
+
+/* Windowed-sinc kernel the renderer's steps are integrated from, shared
+   with resamplers. osc_sinc_row (p) holds the 2*OSC_SINC_HALF taps, for
+   samples -OSC_SINC_HALF+1 to OSC_SINC_HALF, of a point p/OSC_SINC_PHASES
+   sample past sample 0, with a gain of exactly 1. osc_sinc_table () is
+   one side of the kernel itself, OSC_SINC_PHASES points per sample up to
+   OSC_SINC_HALF samples, then zeros up to OSC_SINC_HALF + 1, for stretched
+   (lowpassed) versions. */
+
+#define OSC_SINC_HALF 32
+#define OSC_SINC_PHASES 256
+
+/* Cutoff of that kernel, as a fraction of the Nyquist frequency. Streams
+   are rendered with a gain of 1/OSC_CUTOFF: levels meant to come out as
+   they are must be scaled by OSC_CUTOFF. */
+
+#define OSC_CUTOFF 0.83
+
 /* Functions */
 
 void osc_init (int sample_rate);
 osc_stream *osc_new_stream (void);
+void osc_free_stream (osc_stream *s);
 osc_clock osc_time_dependency (osc_stream *s, int num_samples);
 void osc_update_stream (osc_stream *s, osc_segdef segment);
 void osc_render_stream (osc_stream *s, int num_samples, osc_sample *buffer);
+
+osc_poly *osc_new_poly (void);
+void osc_free_poly (osc_poly *p);
+void osc_voice_square (osc_poly *p, int v, osc_clock time, double freq, double amp);
+void osc_voice_sawtooth (osc_poly *p, int v, osc_clock time, double freq, double amp);
+void osc_voice_stop (osc_poly *p, int v, osc_clock time);
+void osc_poly_retune (osc_poly *p, osc_clock time, double ratio);
+void osc_poly_advance (osc_poly *p, osc_clock deadline);
+
+const float *osc_sinc_row (int phase);
+const float *osc_sinc_table (void);
@@ -23,22 +23,84 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stdint.h>
+#include <limits.h>
 #include <alsa/asoundlib.h>
 #include <assert.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include "libpolyseg.h"
+#include "vecops.h"
 
-#define VERSION "0.1.4b"
+#define VERSION "0.1.5"
 
-#define SAMPLE_RATE 48000
 #define MAX_COMP_ARGS 8
 
+// Period size and sample rate are chosen at startup (-p, -r), then ALSA
+// has the last word. Buffers on the stack or in static storage are sized
+// for the largest period.
+//
 // Odroid-U2: We get xruns while reading the micro-SD if less than 256.
 //            Otherwise, 64 is fine.
-#define PSIZE 60
+#define MAX_PSIZE 2048
+#define MIN_SRATE 8000
+#define MAX_SRATE 192000
+int psize = 60;
+int srate = 48000;
+
+#define MAX_CHANNELS 8
+int out_channels = 2;	// Written to ALSA (-c)
+
+// Bytebeat runs at its own rate (-b), up to the sample rate, so a period
+// doesn't hold a whole number of steps. Bytebeat signals are sized for the
+// most a period can hold; bb_steps of them actually start in this period,
+// the first one bb_phase/bb_rate samples in.
+#define MAX_BB_SIZE MAX_PSIZE
+int bb_rate = 8000;
+int bb_size = 10;
+int bb_steps = 10;
+long bb_phase = 0;
+long bb_next = 0;	// bb_phase of the next period
+
+void set_bb_sizes (void)
+{
+	if (bb_rate > srate)
+		bb_rate = srate;
+	if (bb_rate < 1)
+		bb_rate = 1;
+
+	bb_size = ((long) psize * bb_rate + srate - 1) / srate;
+
+	// Starting over with a step right at the start of the period
+	bb_steps = bb_size;
+	bb_phase = bb_next = 0;
+}
+
+void set_period_size (int frames)
+{
+	if (frames < 1)
+		frames = 1;
+	if (frames > MAX_PSIZE)
+		frames = MAX_PSIZE;
+
+	psize = frames;
+	set_bb_sizes();
+}
 
-#define BB_OVERSAMPLE 6
-#define BB_SIZE (PSIZE / BB_OVERSAMPLE)
+// At the start of each period
+void bb_advance (void)
+{
+	long len;
+
+	len = (long) psize * bb_rate;
+	bb_phase = bb_next;
+	bb_steps = bb_phase < len ? (len - bb_phase + srate - 1) / srate : 0;
+	bb_next = bb_phase + (long) bb_steps * srate - len;
+}
 
 // ALSA
 snd_seq_t *seq;
@@ -50,9 +112,8 @@ int output[19][9];
 
 typedef float sig_audio;
 
-sig_audio silence [PSIZE];
-char empty_array [8][8];
-int silence_bb [BB_SIZE];
+sig_audio silence [MAX_PSIZE];
+int silence_bb [MAX_BB_SIZE];
 
 unsigned long session_timer = 0;
 unsigned long dump_timer = 0;
@@ -88,6 +149,7 @@ typedef enum
 	SIG_AUDIO,
 	SIG_UI,
 	SIG_BYTEBEAT,
+	SIG_CONTROL,
 	SIG_PAIR
 } sig_type;
 
@@ -95,15 +157,36 @@ typedef struct
 {
 	sig_type type;
 	int size;	// In bytes, including this header
+	int refs;	// Number of owners (tables, pairs, delay lines...)
+	int frames;	// Samples per period (audio, bytebeat and control)
+	int channels;	// Audio: one plane of 'frames' samples per channel
 } sig_head;
 
 typedef sig_audio *sig_t_audio;	// FIXME: refs in the mallocs
 
-typedef char t_line[8];
-typedef t_line *sig_t_ui;		// FIXME: refs in the mallocs
+// An 8x8 grid of buttons, one bit per button: bit x*8+y is row x, column
+// y, so that each row is a byte. The UI ops work on whole grids at once.
+typedef uint64_t sig_t_ui;
+
+#define UI_BIT(x, y) ((sig_t_ui) 1 << ((x) * 8 + (y)))
+#define UI_CELL(g, x, y) (((g) >> ((x) * 8 + (y))) & 1)
 
 typedef int *sig_t_bytebeat;	// FIXME: refs in the mallocs
 
+// Control signals change far slower than audio: one value per period, or a
+// linear ramp from 'start' (first sample) towards 'end' (first sample of the
+// next period). Ops that can work on the two ends directly don't have to
+// touch every sample.
+typedef struct
+{
+	sig_audio start;
+	sig_audio end;
+} sig_control;
+
+typedef sig_control *sig_t_control;
+
+sig_control silence_control = { 0, 0 };
+
 // Instance graph
 
 typedef struct {
@@ -112,6 +195,7 @@ typedef struct {
 } coord;
 
 typedef sig_head *(*compop) (sig_head **, void **);
+typedef void (*compfree) (void *);
 
 typedef struct component
 {
@@ -119,390 +203,1683 @@ typedef struct component
 	coord p;
 	compop op;
 	int num_inputs;
+	int pure;	// Same inputs again, same output and state: can be skipped
+	int reads_ui;	// Also reads the buttons directly
+	compfree free_state;	// Releases what the state holds, if anything
 } component;
 
+// Evaluation timings of an instance (see "Profiling")
+typedef struct
+{
+	unsigned long long min, max, sum;	// Current window
+	int runs;
+	unsigned long long last_min, last_avg, last_max;	// Last window
+} prof_stat;
+
 typedef struct instance
 {
-	int empty;
+	coord p;	// Where it is on the grid
 	component c;
 	coord inputs[MAX_COMP_ARGS];
+	int src[MAX_COMP_ARGS];	// Input instances in inst_list, -1 for empty spots
 	void *state;
+	sig_head *out;
+	unsigned long gen;	// Bumped every time 'out' is replaced
+	int fresh;	// Not evaluated since the graph changed
+	unsigned long seen[MAX_COMP_ARGS];	// Input generations last time
+	unsigned long seen_ui;
+	prof_stat prof;
 } instance;
 
 // Global tables
+//
+// The instance grid is 8 columns wide and as long as needed, shown 8 rows
+// at a time. Only live instances are stored: packed in inst_list, in no
+// particular order, and found by position through inst_map (see "Instance
+// storage"). Indices into inst_list only hold until the graph changes.
 component comp_table[8][8];
-instance inst_table[8][64];
-sig_head *sig_table[8][64];
-sig_head *sig_table2[8][64];
+instance *inst_list = NULL;
+int num_insts = 0;
+int max_insts = 0;
+int *inst_map = NULL;	// Open addressing on positions, -1 for free buckets
+int map_size = 0;
+unsigned long ui_gen = 0;	// Bumped every time a button changes
+
+// Fused bytebeat expressions (see "Bytebeat fusion")
+#define BB_MAX_CODE 64
+#define BB_MAX_LEAVES 8
+#define BB_STACK 16
+#define BB_BLOCK 16	// Steps per pass over the program
 
-int inst_page;
+typedef struct
+{
+	int len;
+	char code[BB_MAX_CODE];
+	char arg[BB_MAX_CODE];		// Leaf or clock the instruction reads
+	int num_leaves;
+	int leaves[BB_MAX_LEAVES];	// Signals read as they are
+	int num_clocks;
+	int *clocks[BB_MAX_LEAVES];	// State of the absorbed op_bb_time
+	int clock_at[BB_MAX_LEAVES];
+} bb_prog;
+
+// By instance, sized at schedule build
+bb_prog **bb_fused = NULL;	// op_bb_audio instances running a program
+char *bb_absorbed = NULL;	// Instances folded into a program, not evaluated
+int bb_fused_len = 0;
+int bb_fusion = 1;
+
+void bb_fuse (void);
+sig_head *bb_run (int i);
+
+// Fused elementwise audio chains (see "Elementwise fusion")
+#define EW_MAX_CODE 32
+#define EW_MAX_LOADS 8
 
-sig_head sig_error_c;
+typedef struct
+{
+	int len;
+	vec_insn code[EW_MAX_CODE];
+	int at[EW_MAX_CODE];		// Instance behind each instruction
+	char parent[EW_MAX_CODE];	// Instruction reading the result
+	int num_leaves;
+	int leaves[EW_MAX_LOADS];	// Distinct instances loaded
+	unsigned long seen[EW_MAX_LOADS];
+} ew_prog;
+
+// By instance, sized at schedule build
+ew_prog **ew_fused = NULL;	// Chain ends running a program
+char *ew_absorbed = NULL;	// Instances folded into a program, not evaluated
+int ew_fused_len = 0;
+int ew_fusion = 1;
+
+void ew_fuse (void);
+int ew_unchanged (int i);
+sig_head *ew_run (int i);
+
+// Evaluation schedule: live instances, dependencies first
+int *schedule = NULL;
+int schedule_len = 0;
+int schedule_dirty = 1;
+
+int inst_page;	// Rows inst_page*8 to inst_page*8+7 are on the pads
+
+sig_head sig_error_c = { SIG_ERROR, sizeof (sig_head), 0 };
 
 sig_head *sig_error (void)
 {
 	return &sig_error_c;
 }
 
-sig_head *sig_dup (sig_head *in)
+// Signal buffer pool
+//
+// Buffers are recycled through per-size-class free lists instead of going
+// back to the heap every period. Once a patch has warmed up, computing the
+// signals doesn't call malloc() or free() anymore.
+//
+// Buffers are reference counted and read-only once an operator has returned
+// them, so that forwarding a signal (identity, pair elements, delays) only
+// costs a new reference instead of a copy.
+//
+// Instances are evaluated by several threads, hence the atomic reference
+// counts and the (short) per-class spinlocks.
+
+#define POOL_MIN_SHIFT 6	// Smallest class: 64 bytes
+#define POOL_CLASSES 16		// Largest class: 2 MB
+
+typedef struct pool_block
 {
-	sig_head *out;
+	struct pool_block *next;
+} pool_block;
 
-	if (in->type == SIG_ERROR)
-		out = in;
-	else
-	{
-		out = malloc (in->size);
-		memcpy (out, in, in->size);
-	}
+pool_block *pool_free_list[POOL_CLASSES];
+volatile int pool_lock[POOL_CLASSES];
+unsigned long pool_heap_allocs = 0;
 
-	return out;
+#define spin_lock(l) while (__sync_lock_test_and_set (&(l), 1)) while (__atomic_load_n (&(l), __ATOMIC_RELAXED))
+#define spin_unlock(l) __sync_lock_release (&(l))
+
+int pool_class (int size)
+{
+	int c;
+
+	c = 0;
+	while (c < POOL_CLASSES && (1 << (c + POOL_MIN_SHIFT)) < size)
+		c++;
+
+	return c < POOL_CLASSES ? c : -1;
 }
 
-void compute_signals (void)
+sig_head *sig_alloc (int size)
 {
-	int x, y, a;
-	instance *inst;
-	sig_head *in[MAX_COMP_ARGS];
+	pool_block *b;
 	sig_head *out;
+	int c;
 
-	// Compute new buffers
-	for (x=0; x<8; x++) for (y=0; y<64; y++)
-	{
-		inst = &inst_table[x][y];
-		if (! inst->empty)
-		{
-			for (a = 0; a < inst->c.num_inputs; a++)
-				in[a] = sig_table [inst->inputs[a].x] [inst->inputs[a].y];
-
-			out = (*(inst->c.op)) (in, &inst->state);
-			sig_table2[x][y] = out;
-		}
-		else
-		{
-			sig_table2[x][y] = sig_error();
-		}
-	}
+	c = pool_class (size);
+	b = NULL;
 
-	// Free old buffers
-	for (x=0; x<8; x++) for (y=0; y<64; y++)
+	if (c >= 0)
 	{
-		if (sig_table[x][y]->type != SIG_ERROR)
-			free (sig_table[x][y]);
+		spin_lock (pool_lock[c]);
+		b = pool_free_list[c];
+		if (b != NULL)
+			pool_free_list[c] = b->next;
+		spin_unlock (pool_lock[c]);
 	}
 
-	// Copy back new buffers
-	for (x=0; x<8; x++) for (y=0; y<64; y++)
+	if (b != NULL)
 	{
-		sig_table[x][y] = sig_table2[x][y];
+		out = (sig_head *) b;
 	}
-}
-
-//==============================================================================
-// Launchpad interface
+	else
+	{
+		__sync_add_and_fetch (&pool_heap_allocs, 1);
 
-typedef struct {
-	coord p;
-	int v;
-} button_evt;
+		if (c < 0)
+			out = malloc (size);
+		else
+			out = malloc (1 << (c + POOL_MIN_SHIFT));
+	}
 
-typedef struct {
-	coord p, q;
-} zone;
+	out->refs = 1;
+	out->channels = 1;
 
-zone z_left = {{1,1}, {8,8}};
-zone z_right = {{10,1}, {17,8}};
-zone z_lup = {{1,0}, {8,0}};
-zone z_lside = {{0,1}, {0,8}};
-zone z_rup = {{10,0}, {17,0}};
-zone z_rside = {{18,1}, {18,8}};
+	return out;
+}
 
-int in_zone (coord c, zone z)
+sig_head *sig_ref (sig_head *s)
 {
-	if (c.x >= z.p.x && c.x <= z.q.x && c.y >= z.p.y && c.y <= z.q.y)
-		return 1;
-	else
-		return 0;
+	if (s->type != SIG_ERROR)
+		__sync_add_and_fetch (&s->refs, 1);
+
+	return s;
 }
 
-button_evt *get_input (void)
-{
-	int val;
-	int x, y;
-	int px, py;
-	int pad;
-	button_evt *res = NULL;
-	snd_seq_event_t *evp;
+sig_head *sig_elem (sig_head *pair, int n);
 
-	val = -1;
+void sig_unref (sig_head *s)
+{
+	pool_block *b;
+	int c;
 
-	snd_seq_event_input (seq, &evp);
+	if (s->type == SIG_ERROR)
+		return;
 
-	if (evp == NULL) return NULL;
+	if (__sync_sub_and_fetch (&s->refs, 1) > 0)
+		return;
 
-	if (evp->type == SND_SEQ_EVENT_CONTROLLER)
-	{
-		val = evp->data.control.value > 0;
-		px = evp->data.control.param - 104;
-		py = 0;
-	}
-	else if (evp->type == SND_SEQ_EVENT_NOTEON)
+	if (s->type == SIG_PAIR)
 	{
-		val = evp->data.note.velocity > 0;
-		px = evp->data.note.note % 16;
-		py = evp->data.note.note / 16 + 1;
+		sig_unref (sig_elem (s, 0));
+		sig_unref (sig_elem (s, 1));
 	}
-	else return NULL;
 
-	for (pad=0; pad<2; pad++)
-		if (evp->dest.port == ports[pad])
-			break;
+	c = pool_class (s->size);
 
-	switch (pad)
+	if (c < 0)
 	{
-		case 0:
-			x = py;
-			y = 8 - px;
-			break;
-		case 1:
-			x = 10 + px;
-			y = py;
-			break;
-		default:
-			return NULL;
+		free (s);
 	}
-
-	if (val >= 0)
+	else
 	{
-		res = malloc (sizeof (button_evt));
-		// printf ("%d, %d, %d\n", x, y, val);
-		res->p.x = x;
-		res->p.y = y;
-		res->v = val;
+		b = (pool_block *) s;
+		spin_lock (pool_lock[c]);
+		b->next = pool_free_list[c];
+		pool_free_list[c] = b;
+		spin_unlock (pool_lock[c]);
 	}
+}
 
-	return res;
+// New buffer of the same type and size as 'in', contents left undefined
+sig_head *sig_new_like (sig_head *in)
+{
+	sig_head *out;
+
+	out = sig_alloc (in->size);
+	out->type = in->type;
+	out->size = in->size;
+	out->frames = in->frames;
+	out->channels = in->channels;
+
+	return out;
 }
 
-static int output_old[19][9];
+// New audio buffer, one plane of psize samples per channel
+sig_head *sig_new_audio (int channels)
+{
+	sig_head *out;
+	int size;
 
-void update_output (void)
+	size = sizeof (sig_head) + channels * psize * sizeof (sig_audio);
+	out = sig_alloc (size);
+	out->type = SIG_AUDIO;
+	out->size = size;
+	out->frames = psize;
+	out->channels = channels;
+
+	return out;
+}
+
+sig_head *sig_new_control (sig_audio start, sig_audio end)
 {
-	int x, y;
-	int px, py;
-	int color;
-	int pad;
+	sig_head *out;
+	sig_t_control c;
+	int size;
 
-	for (x=0; x<19; x++) for (y=0; y<9; y++)
-	{
-		if (output[x][y] != output_old[x][y])
-		{
-			output_old[x][y] = color = output[x][y];
+	size = sizeof (sig_head) + sizeof (sig_control);
+	out = sig_alloc (size);
+	out->type = SIG_CONTROL;
+	out->size = size;
+	out->frames = psize;
 
-			pad = x > 9;
+	c = (void *) (out + 1);
+	c->start = start;
+	c->end = end;
 
-			switch (pad)
-			{
-				case 0:
-					px = 8 - y;
-					py = x;
-					break;
-				case 1:
-					px = x - 10;
-					py = y;
-					break;
-			}
+	return out;
+}
 
-			if (py == 0 && px >= 0 && px <= 7)
-			{
-				snd_seq_ev_set_controller (&aev, 0, 104+px, color);
-			}
-			else if (py >= 1 && py <= 8 && px >= 0 && px <= 8)
-			{
-				snd_seq_ev_set_noteon (&aev, 0, (py-1)*16+px, color);
-			}
-			else continue;
+sig_head *sig_new_ui (sig_t_ui grid)
+{
+	sig_head *out;
+	int size;
 
-			snd_seq_ev_set_source (&aev, ports[pad]);
-			snd_seq_event_output (seq, &aev);
-		}
-	}
+	size = sizeof (sig_head) + sizeof (sig_t_ui);
+	out = sig_alloc (size);
+	out->type = SIG_UI;
+	out->size = size;
 
-	// Quick hack to reconnect buggy keypads...
-	snd_seq_connect_from (seq, ports[0], 20 + 4 * 0, 0);
-	snd_seq_connect_to   (seq, ports[0], 20 + 4 * 0, 0);
-	snd_seq_connect_from (seq, ports[1], 20 + 4 * 1, 0);
-	snd_seq_connect_to   (seq, ports[1], 20 + 4 * 1, 0);
+	// The header only leaves it 4-byte aligned
+	memcpy (out + 1, &grid, sizeof (grid));
 
-	snd_seq_drain_output (seq);
+	return out;
 }
 
-void put_color (coord p, int c)
+// Samples of a control signal, for the ops that need them one by one
+void control_expand (sig_head *in, sig_t_audio out)
 {
-	output[p.x][p.y] = c;
+	sig_t_control c;
+	sig_audio step;
+	int a;
+
+	c = (void *) (in + 1);
+	step = (c->end - c->start) / in->frames;
+
+	for (a = 0; a < in->frames; a++)
+		out[a] = c->start + step * a;
 }
 
-void display_editor (void)
+int audio_channels (sig_head *in)
 {
-	int x, y;
+	return in->type == SIG_AUDIO ? in->channels : 1;
+}
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
+// Samples of channel c of an audio or control signal, silence for anything
+// else. Channels are reused round-robin when c is past the last one, so a
+// mono signal has the same samples on every channel. Control signals are
+// expanded into 'buf'.
+sig_t_audio audio_plane (sig_head *in, int c, sig_t_audio buf)
+{
+	if (in->type == SIG_AUDIO)
+		return (sig_t_audio) (in + 1) + (c % in->channels) * in->frames;
+
+	if (in->type == SIG_CONTROL)
 	{
-		if (comp_table[x][y].empty)
-			output[x+1][y+1] = C_BLACK;
-		else
-			output[x+1][y+1] = C_GREEN;
+		control_expand (in, buf);
+		return buf;
 	}
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
+	return silence;
+}
+
+// The same, with all channels mixed down, for the ops that are mono only
+sig_t_audio audio_samples (sig_head *in, sig_t_audio buf)
+{
+	sig_t_audio s;
+	int a, c;
+
+	if (in->type != SIG_AUDIO || in->channels == 1)
+		return audio_plane (in, 0, buf);
+
+	s = (void *) (in + 1);
+	for (a = 0; a < in->frames; a++)
 	{
-		if (inst_table[x][y+inst_page*8].empty)
-			output[x+10][y+1] = C_BLACK;
-		else
-			output[x+10][y+1] = C_GREEN;
+		buf[a] = 0;
+		for (c = 0; c < in->channels; c++)
+			buf[a] += s[c * in->frames + a];
+		buf[a] /= in->channels;
 	}
 
-	for (y=0; y<8; y++)
-		output[18][y+1] = C_BLACK;
-
-	output[18][inst_page+1] = C_YELLOW;
+	return buf;
 }
 
-//==============================================================================
-// ALSA interface (MIDI and audio)
+sig_t_control control_of (sig_head *in)
+{
+	if (in->type == SIG_CONTROL)
+		return (void *) (in + 1);
 
-int audio_ok = 0;
-snd_pcm_t *handle;
+	return &silence_control;
+}
 
-void user_init (void)
+// Nothing pressed for anything but a UI signal
+sig_t_ui ui_of (sig_head *in)
 {
-	int res;
-	int pad;
-	char *name;
+	sig_t_ui grid;
 
-	// MIDI
-	snd_seq_open (&seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
-	snd_seq_set_client_name (seq, "Stacy");
-	snd_seq_nonblock (seq, 1);
+	if (in->type != SIG_UI)
+		return 0;
 
-	snd_seq_ev_set_fixed  (&aev);
-	snd_seq_ev_set_direct (&aev);
-	snd_seq_ev_set_dest   (&aev, SND_SEQ_ADDRESS_SUBSCRIBERS, 0);
+	memcpy (&grid, in + 1, sizeof (grid));
+	return grid;
+}
 
-	name = malloc (42);
+// A pair is a header followed by references to its two elements
+sig_head *sig_elem (sig_head *pair, int n)
+{
+	sig_head **e;
 
-	for (pad=0; pad<2; pad++)
-	{
-		sprintf (name, "Array %d", pad);
+	e = (void *) (pair + 1);
 
-		ports[pad] = snd_seq_create_simple_port (seq, name, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE | SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+	return e[n];
+}
 
-		snd_seq_connect_from (seq, ports[pad], 20 + 4 * pad, 0);
-		snd_seq_connect_to   (seq, ports[pad], 20 + 4 * pad, 0);
+// Instance storage
+//
+// inst_map hashes positions with linear probing and is kept at most half
+// full. Positions are numbered row by row, and multiplying consecutive
+// numbers by an odd constant sends them to distinct buckets. Removing an
+// instance moves the last one into its place and rebuilds the map, which
+// only happens when the patch is edited.
 
-		// Reset Launchpad
-		snd_seq_ev_set_controller (&aev, 0, 0, 0);
-		snd_seq_ev_set_source (&aev, ports[pad]);
-		snd_seq_event_output (seq, &aev);
+int map_bucket (coord p)
+{
+	unsigned int b;
+	int i;
+
+	b = ((unsigned int) p.y * 8 + p.x) * 2654435761u;
+	for (;; b++)
+	{
+		i = inst_map[b & (map_size - 1)];
+		if (i < 0 || (inst_list[i].p.x == p.x && inst_list[i].p.y == p.y))
+			return b & (map_size - 1);
+	}
+}
+
+void map_rebuild (int size)
+{
+	int i;
+
+	map_size = size;
+	inst_map = realloc (inst_map, size * sizeof (int));
+	for (i = 0; i < size; i++)
+		inst_map[i] = -1;
+	for (i = 0; i < num_insts; i++)
+		inst_map[map_bucket (inst_list[i].p)] = i;
+}
+
+// Instance states are freed with whatever they hold: buffers, signals
+// kept for later...
+void state_free (instance *inst)
+{
+	if (inst->state && inst->c.free_state)
+		(*inst->c.free_state) (inst->state);
+
+	free (inst->state);
+	inst->state = NULL;
+}
+
+// Index of the instance at 'p' in inst_list, -1 if there is none
+int inst_find (coord p)
+{
+	if (num_insts == 0)
+		return -1;
+
+	return inst_map[map_bucket (p)];
+}
+
+instance *inst_at (coord p)
+{
+	int i;
+
+	i = inst_find (p);
+	return i < 0 ? NULL : &inst_list[i];
+}
+
+// Output of instance i, an error for an empty spot
+sig_head *sig_of (int i)
+{
+	return i < 0 ? sig_error() : inst_list[i].out;
+}
+
+unsigned long gen_of (int i)
+{
+	return i < 0 ? 0 : inst_list[i].gen;
+}
+
+sig_head *sig_at (coord p)
+{
+	return sig_of (inst_find (p));
+}
+
+// Puts an instance of def->c reading def->inputs at 'p', in place of
+// whatever was there
+void inst_put (coord p, instance *def)
+{
+	instance *inst;
+	unsigned long gen;
+	int i;
+
+	i = inst_find (p);
+	if (i < 0)
+	{
+		if (num_insts == max_insts)
+		{
+			max_insts = max_insts ? 2 * max_insts : 64;
+			inst_list = realloc (inst_list, max_insts * sizeof (instance));
+		}
+
+		i = num_insts++;
+		inst_list[i].p = p;
+		inst_list[i].out = sig_error();
+		inst_list[i].gen = 0;
+		if (2 * num_insts > map_size)
+			map_rebuild (map_size ? 2 * map_size : 128);
+		else
+			inst_map[map_bucket (p)] = i;
+	}
+	else
+	{
+		state_free (&inst_list[i]);
+	}
+
+	inst = &inst_list[i];
+	gen = inst->gen;
+	sig_unref (inst->out);
+
+	bzero (inst, sizeof (instance));
+	inst->p = p;
+	inst->c = def->c;
+	memcpy (inst->inputs, def->inputs, sizeof (inst->inputs));
+	inst->out = sig_error();
+	inst->gen = gen + 1;
+
+	schedule_dirty = 1;
+}
+
+void inst_remove (coord p)
+{
+	int i;
+
+	i = inst_find (p);
+	if (i < 0)
+		return;
+
+	state_free (&inst_list[i]);
+	sig_unref (inst_list[i].out);
+
+	inst_list[i] = inst_list[--num_insts];
+	map_rebuild (map_size);
+
+	schedule_dirty = 1;
+}
+
+void inst_clear (void)
+{
+	int i;
+
+	for (i = 0; i < num_insts; i++)
+	{
+		state_free (&inst_list[i]);
+		sig_unref (inst_list[i].out);
+	}
+
+	num_insts = 0;
+	map_rebuild (map_size ? map_size : 128);
+
+	schedule_dirty = 1;
+}
+
+// Grid order, column by column or row by row
+int column_cmp (const void *a, const void *b)
+{
+	const coord *p = &inst_list[*(const int *) a].p;
+	const coord *q = &inst_list[*(const int *) b].p;
+
+	if (p->x != q->x)
+		return p->x - q->x;
+	return p->y - q->y;
+}
+
+int row_cmp (const void *a, const void *b)
+{
+	const coord *p = &inst_list[*(const int *) a].p;
+	const coord *q = &inst_list[*(const int *) b].p;
+
+	if (p->y != q->y)
+		return p->y - q->y;
+	return p->x - q->x;
+}
+
+// Indices of the live instances, sorted
+int *inst_sorted (int (*cmp) (const void *, const void *))
+{
+	int *order;
+	int i;
+
+	order = malloc ((num_insts + 1) * sizeof (int));
+	for (i = 0; i < num_insts; i++)
+		order[i] = i;
+	qsort (order, num_insts, sizeof (int), cmp);
+
+	return order;
+}
+
+// Schedule building
+//
+// Depth-first walk of the inputs, so that an instance comes after the
+// instances it reads from and sees their output of the current period.
+// An edge closing a cycle is left alone: the instance at its end is
+// evaluated later and is read one period late, which is the only place
+// where a period of latency remains. The walk starts from the instances
+// in grid order, so that where a cycle is cut doesn't depend on the order
+// they were created in.
+
+enum { V_NEW = 0, V_ACTIVE, V_DONE };
+
+void schedule_visit (int i, char *visit)
+{
+	instance *inst;
+	int a, j;
+
+	visit[i] = V_ACTIVE;
+
+	inst = &inst_list[i];
+	for (a = 0; a < inst->c.num_inputs; a++)
+	{
+		j = inst->src[a];
+		if (j >= 0 && visit[j] == V_NEW)
+			schedule_visit (j, visit);
+	}
+
+	visit[i] = V_DONE;
+	schedule[schedule_len++] = i;
+}
+
+void schedule_build (void)
+{
+	instance *inst;
+	char *visit;
+	int *order;
+	int i, a;
+
+	visit = calloc (num_insts + 1, 1);
+	schedule = realloc (schedule, (num_insts + 1) * sizeof (int));
+	schedule_len = 0;
+
+	for (i = 0; i < num_insts; i++)
+	{
+		inst = &inst_list[i];
+		for (a = 0; a < inst->c.num_inputs; a++)
+			inst->src[a] = inst_find (inst->inputs[a]);
+		inst->fresh = 1;
+	}
+
+	order = inst_sorted (column_cmp);
+	for (i = 0; i < num_insts; i++)
+	{
+		if (visit[order[i]] == V_NEW)
+			schedule_visit (order[i], visit);
+	}
+
+	free (visit);
+	free (order);
+
+	bb_fuse();
+	ew_fuse();
+
+	schedule_dirty = 0;
+}
+
+// Incremental evaluation
+//
+// Every signal has a generation, bumped whenever its instance replaces it.
+// A pure instance whose inputs (and buttons, for those reading them) are
+// still at the generations it saw last time would compute the same thing
+// again: it is skipped and its previous output stays in place, so that
+// whatever reads it is skipped in turn.
+
+int inputs_unchanged (instance *inst)
+{
+	unsigned long gen;
+	int a, same;
+
+	same = ! inst->fresh;
+	inst->fresh = 0;
+
+	for (a = 0; a < inst->c.num_inputs; a++)
+	{
+		gen = gen_of (inst->src[a]);
+		if (gen != inst->seen[a])
+			same = 0;
+		inst->seen[a] = gen;
+	}
+
+	if (inst->c.reads_ui)
+	{
+		if (ui_gen != inst->seen_ui)
+			same = 0;
+		inst->seen_ui = ui_gen;
+	}
+
+	return same;
+}
+
+void eval_instance (int i)
+{
+	instance *inst;
+	sig_head *in[MAX_COMP_ARGS];
+	sig_head *out;
+	int a;
+
+	inst = &inst_list[i];
+
+	if (bb_fused[i])
+	{
+		out = bb_run (i);
+	}
+	else if (ew_fused[i])
+	{
+		if (ew_unchanged (i))
+			return;
+
+		out = ew_run (i);
+	}
+	else
+	{
+		if (inst->c.pure && inputs_unchanged (inst))
+			return;
+
+		for (a = 0; a < inst->c.num_inputs; a++)
+			in[a] = sig_of (inst->src[a]);
+
+		out = (*(inst->c.op)) (in, &inst->state);
+	}
+
+	sig_unref (inst->out);
+	inst->out = out;
+	inst->gen++;
+}
+
+//==============================================================================
+// Profiling
+//
+// Every evaluation of an instance is timed with the CPU's cycle counter (a
+// nanosecond clock where there is none), and so is every period. Instance
+// timings are gathered one second at a time and published as min/avg/max;
+// period timings go to a histogram of the load against the real-time
+// budget. In utility mode the instance grid shows what each instance costs,
+// and the figures can be dumped to a file every DUMP_PERIODS periods.
+
+#define PROF_WINDOW (srate > psize ? srate / psize : 1)	// One second
+#define PROF_BUCKETS 12		// Tenths of the budget, then up to 2x, then more
+#define DUMP_PERIODS (10 * PROF_WINDOW)
+
+unsigned long prof_hist[PROF_BUCKETS];
+unsigned long prof_periods = 0;
+int prof_updated = 0;
+int prof_dumping = 0;
+double prof_ticks_per_ns = 1;
+
+unsigned long long prof_ticks (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+void prof_init (void)
+{
+	struct timespec t0, t1;
+	unsigned long long c0, c1;
+	double ns;
+
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	c0 = prof_ticks();
+	usleep (20000);
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	c1 = prof_ticks();
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	prof_ticks_per_ns = (c1 - c0) / ns;
+}
+
+double prof_budget (void)
+{
+	return 1e9 * psize / srate * prof_ticks_per_ns;
+}
+
+// Each instance is evaluated by a single worker per period, so the
+// counters don't need to be atomic.
+void eval_profiled (int i)
+{
+	unsigned long long start, t;
+	prof_stat *s;
+
+	start = prof_ticks();
+	eval_instance (i);
+	t = prof_ticks() - start;
+
+	s = &inst_list[i].prof;
+	if (s->runs == 0 || t < s->min)
+		s->min = t;
+	if (s->runs == 0 || t > s->max)
+		s->max = t;
+	s->sum += t;
+	s->runs++;
+}
+
+void prof_period (unsigned long long t)
+{
+	prof_stat *s;
+	double load;
+	int b, i;
+
+	load = t / prof_budget();
+	if (load < 1)
+		b = load * 10;
+	else
+		b = load < 2 ? 10 : 11;
+	prof_hist[b]++;
+
+	if (++prof_periods % PROF_WINDOW != 0)
+		return;
+
+	for (i = 0; i < num_insts; i++)
+	{
+		s = &inst_list[i].prof;
+		if (s->runs)
+		{
+			s->last_min = s->min;
+			s->last_avg = s->sum / s->runs;
+			s->last_max = s->max;
+		}
+		else
+		{
+			s->last_min = s->last_avg = s->last_max = 0;
+		}
+		s->sum = 0;
+		s->runs = 0;
+	}
+
+	prof_updated = 1;
+}
+
+//==============================================================================
+// Parallel evaluation
+//
+// Every scheduled instance is a task. A task waits for the instances whose
+// current output it reads and, if it reads one of them a period late (the
+// edge closes a cycle), that instance waits for it in return, so that the
+// old output isn't replaced under its feet. Since both kinds of constraint
+// point forward in the schedule, this is a DAG and the result doesn't depend
+// on which thread runs what.
+//
+// Released tasks go to the deque of the worker that released them, idle
+// workers steal from the others. The main thread is worker 0 and only
+// returns once every task is done and every helper has gone back to sleep.
+//
+// Waiting is a short spin, then sleep: a worker with nothing to steal
+// parks until a task is pushed or the period is over, and the main thread
+// sleeps until the last helper is done. Helpers run in the same scheduling
+// class as the main thread, so that none of them can keep it, or a thread
+// holding a spinlock, off its core.
+
+#define MAX_WORKERS 8
+
+typedef struct
+{
+	volatile int lock;
+	int head, tail;
+	int *task;
+} task_deque;
+
+int num_workers = 1;
+task_deque deques[MAX_WORKERS];
+
+// By task, grown with the schedule
+int max_tasks = 0;
+int *task_deps = NULL;		// Constraints on each task
+volatile int *task_pending = NULL;	// Countdown for the current period
+int *succ_start = NULL;		// Tasks released by each task
+int *succ_list = NULL;
+
+volatile int tasks_left = 0;
+volatile int workers_busy = 0;
+volatile int workers_idle = 0;
+unsigned long period_gen = 0;
+
+pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;	// New period
+pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;	// Helpers all done
+pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;	// Task pushed, or none left
+
+#define SPIN_TRIES 2000
+
+#if defined (__x86_64__) || defined (__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax()
+#endif
+
+void tasks_grow (int n)
+{
+	int w;
+
+	max_tasks = n > 2 * max_tasks ? n : 2 * max_tasks;
+	if (max_tasks < 64)
+		max_tasks = 64;
+
+	task_deps = realloc (task_deps, max_tasks * sizeof (int));
+	task_pending = realloc ((int *) task_pending, max_tasks * sizeof (int));
+	succ_start = realloc (succ_start, (max_tasks + 1) * sizeof (int));
+	succ_list = realloc (succ_list, 2 * MAX_COMP_ARGS * max_tasks * sizeof (int));
+
+	for (w = 0; w < MAX_WORKERS; w++)
+		deques[w].task = realloc (deques[w].task, max_tasks * sizeof (int));
+}
+
+void tasks_build (void)
+{
+	int *pos, *from, *to, *fill;
+	int num_edges;
+	instance *inst;
+	bb_prog *pg;
+	ew_prog *ew;
+	int *inputs;
+	int i, j, a, n;
+
+	if (max_tasks == 0 || schedule_len > max_tasks)
+		tasks_grow (schedule_len);
+
+	pos = malloc ((num_insts + 1) * sizeof (int));
+	from = malloc ((2 * MAX_COMP_ARGS * schedule_len + 1) * sizeof (int));
+	to = malloc ((2 * MAX_COMP_ARGS * schedule_len + 1) * sizeof (int));
+	fill = malloc ((schedule_len + 1) * sizeof (int));
+
+	// Absorbed instances aren't tasks
+	for (i = 0; i < num_insts; i++)
+		pos[i] = -1;
+	for (i = 0; i < schedule_len; i++)
+	{
+		pos[schedule[i]] = i;
+		task_deps[i] = 0;
+		succ_start[i] = 0;
+	}
+	succ_start[schedule_len] = 0;
+
+	num_edges = 0;
+	for (i = 0; i < schedule_len; i++)
+	{
+		inst = &inst_list[schedule[i]];
+		inputs = inst->src;
+		n = inst->c.num_inputs;
+
+		// A fused expression reads its leaves instead
+		pg = bb_fused[schedule[i]];
+		if (pg)
+		{
+			inputs = pg->leaves;
+			n = pg->num_leaves;
+		}
+		ew = ew_fused[schedule[i]];
+		if (ew)
+		{
+			inputs = ew->leaves;
+			n = ew->num_leaves;
+		}
+
+		for (a = 0; a < n; a++)
+		{
+			if (inputs[a] < 0 || pos[inputs[a]] < 0)
+				continue;
+
+			j = pos[inputs[a]];
+			if (j < i)
+			{
+				// Current output: wait for it
+				from[num_edges] = j;
+				to[num_edges++] = i;
+			}
+			else if (j > i)
+			{
+				// Previous output: keep it until we've read it
+				from[num_edges] = i;
+				to[num_edges++] = j;
+			}
+		}
+	}
+
+	// Sort the edges by source (counting sort)
+	for (a = 0; a < num_edges; a++)
+	{
+		succ_start[from[a] + 1]++;
+		task_deps[to[a]]++;
+	}
+	for (i = 0; i < schedule_len; i++)
+	{
+		succ_start[i+1] += succ_start[i];
+		fill[i] = succ_start[i];
+	}
+	for (a = 0; a < num_edges; a++)
+		succ_list[fill[from[a]]++] = to[a];
+
+	free (pos);
+	free (from);
+	free (to);
+	free (fill);
+}
+
+// Parked workers see the task or the end of the period, whichever way the
+// race with workers_idle goes (both sides have a full barrier in between)
+void idle_wake (void)
+{
+	__sync_synchronize();
+	if (__atomic_load_n (&workers_idle, __ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_mutex_lock (&idle_mutex);
+	pthread_cond_broadcast (&idle_cond);
+	pthread_mutex_unlock (&idle_mutex);
+}
+
+void deque_push (int w, int t)
+{
+	task_deque *d = &deques[w];
+
+	// tail and head are only changed under the lock, but peeked at without
+	spin_lock (d->lock);
+	d->task[d->tail] = t;
+	__atomic_store_n (&d->tail, d->tail + 1, __ATOMIC_RELAXED);
+	spin_unlock (d->lock);
+
+	idle_wake();
+}
+
+int tasks_ready (void)
+{
+	int w;
+
+	for (w = 0; w < num_workers; w++)
+		if (__atomic_load_n (&deques[w].tail, __ATOMIC_RELAXED)
+				!= __atomic_load_n (&deques[w].head, __ATOMIC_RELAXED))
+			return 1;
+
+	return 0;
+}
+
+void idle_park (void)
+{
+	pthread_mutex_lock (&idle_mutex);
+	__sync_add_and_fetch (&workers_idle, 1);
+	while (__atomic_load_n (&tasks_left, __ATOMIC_RELAXED) > 0 && ! tasks_ready())
+		pthread_cond_wait (&idle_cond, &idle_mutex);
+	__sync_sub_and_fetch (&workers_idle, 1);
+	pthread_mutex_unlock (&idle_mutex);
+}
+
+int deque_pop (int w)
+{
+	task_deque *d = &deques[w];
+	int t = -1;
+
+	spin_lock (d->lock);
+	if (d->tail > d->head)
+	{
+		__atomic_store_n (&d->tail, d->tail - 1, __ATOMIC_RELAXED);
+		t = d->task[d->tail];
+	}
+	spin_unlock (d->lock);
+
+	return t;
+}
+
+int deque_steal (int w)
+{
+	task_deque *d;
+	int a, t = -1;
+
+	for (a = 1; a < num_workers && t < 0; a++)
+	{
+		d = &deques[(w + a) % num_workers];
+
+		if (__atomic_load_n (&d->tail, __ATOMIC_RELAXED) == __atomic_load_n (&d->head, __ATOMIC_RELAXED))
+			continue;
+
+		spin_lock (d->lock);
+		if (d->tail > d->head)
+		{
+			t = d->task[d->head];
+			__atomic_store_n (&d->head, d->head + 1, __ATOMIC_RELAXED);
+		}
+		spin_unlock (d->lock);
+	}
+
+	return t;
+}
+
+void run_tasks (int w)
+{
+	int t, a, tries;
+
+	tries = 0;
+	while (__atomic_load_n (&tasks_left, __ATOMIC_ACQUIRE) > 0)
+	{
+		t = deque_pop (w);
+		if (t < 0)
+			t = deque_steal (w);
+		if (t < 0)
+		{
+			if (++tries < SPIN_TRIES)
+				cpu_relax();
+			else
+			{
+				idle_park();
+				tries = 0;
+			}
+			continue;
+		}
+		tries = 0;
+
+		eval_profiled (schedule[t]);
+
+		for (a = succ_start[t]; a < succ_start[t+1]; a++)
+		{
+			if (__sync_sub_and_fetch (&task_pending[succ_list[a]], 1) == 0)
+				deque_push (w, succ_list[a]);
+		}
+
+		if (__sync_sub_and_fetch (&tasks_left, 1) == 0)
+			idle_wake();
+	}
+}
+
+void *worker_thread (void *arg)
+{
+	int w = (long) arg;
+	unsigned long gen = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock (&work_mutex);
+		while (period_gen == gen)
+			pthread_cond_wait (&work_cond, &work_mutex);
+		gen = period_gen;
+		pthread_mutex_unlock (&work_mutex);
+
+		run_tasks (w);
+
+		if (__sync_sub_and_fetch (&workers_busy, 1) == 0)
+		{
+			pthread_mutex_lock (&work_mutex);
+			pthread_cond_signal (&done_cond);
+			pthread_mutex_unlock (&work_mutex);
+		}
+	}
+
+	return NULL;
+}
+
+void workers_init (int n)
+{
+	pthread_t thread;
+	long w;
+
+	if (n > MAX_WORKERS)
+		n = MAX_WORKERS;
+	if (n < 1)
+		n = 1;
+
+	num_workers = n;
+
+	// Same scheduling as the main thread (see above)
+	for (w = 1; w < num_workers; w++)
+		pthread_create (&thread, NULL, worker_thread, (void *) w);
+}
+
+void eval_period (void)
+{
+	int i, w;
+
+	if (schedule_dirty)
+	{
+		schedule_build();
+		tasks_build();
+	}
+
+	bb_advance();
+
+	if (num_workers == 1)
+	{
+		for (i = 0; i < schedule_len; i++)
+			eval_profiled (schedule[i]);
+		return;
+	}
+
+	for (w = 0; w < num_workers; w++)
+		deques[w].head = deques[w].tail = 0;
+
+	w = 0;
+	for (i = 0; i < schedule_len; i++)
+	{
+		task_pending[i] = task_deps[i];
+		if (task_deps[i] == 0)
+		{
+			deques[w].task[deques[w].tail++] = i;
+			w = (w + 1) % num_workers;
+		}
+	}
+
+	tasks_left = schedule_len;
+	workers_busy = num_workers - 1;
+
+	pthread_mutex_lock (&work_mutex);
+	period_gen++;
+	pthread_cond_broadcast (&work_cond);
+	pthread_mutex_unlock (&work_mutex);
+
+	run_tasks (0);
+
+	// Join: nobody may still be looking at the deques next period
+	for (i = 0; i < SPIN_TRIES && __atomic_load_n (&workers_busy, __ATOMIC_ACQUIRE) > 0; i++)
+		cpu_relax();
+
+	pthread_mutex_lock (&work_mutex);
+	while (__atomic_load_n (&workers_busy, __ATOMIC_ACQUIRE) > 0)
+		pthread_cond_wait (&done_cond, &work_mutex);
+	pthread_mutex_unlock (&work_mutex);
+}
+
+void compute_signals (void)
+{
+	unsigned long long start;
+
+	start = prof_ticks();
+	eval_period();
+	prof_period (prof_ticks() - start);
+}
+
+//==============================================================================
+// Launchpad interface
+
+typedef struct {
+	coord p;
+	int v;
+} button_evt;
+
+typedef struct {
+	coord p, q;
+} zone;
+
+zone z_left = {{1,1}, {8,8}};
+zone z_right = {{10,1}, {17,8}};
+zone z_lup = {{1,0}, {8,0}};
+zone z_lside = {{0,1}, {0,8}};
+zone z_rup = {{10,0}, {17,0}};
+zone z_rside = {{18,1}, {18,8}};
+
+int in_zone (coord c, zone z)
+{
+	if (c.x >= z.p.x && c.x <= z.q.x && c.y >= z.p.y && c.y <= z.q.y)
+		return 1;
+	else
+		return 0;
+}
+
+button_evt *get_input (void)
+{
+	int val;
+	int x, y;
+	int px, py;
+	int pad;
+	button_evt *res = NULL;
+	snd_seq_event_t *evp;
+
+	val = -1;
+
+	snd_seq_event_input (seq, &evp);
+
+	if (evp == NULL) return NULL;
+
+	if (evp->type == SND_SEQ_EVENT_CONTROLLER)
+	{
+		val = evp->data.control.value > 0;
+		px = evp->data.control.param - 104;
+		py = 0;
+	}
+	else if (evp->type == SND_SEQ_EVENT_NOTEON)
+	{
+		val = evp->data.note.velocity > 0;
+		px = evp->data.note.note % 16;
+		py = evp->data.note.note / 16 + 1;
+	}
+	else return NULL;
+
+	for (pad=0; pad<2; pad++)
+		if (evp->dest.port == ports[pad])
+			break;
+
+	switch (pad)
+	{
+		case 0:
+			x = py;
+			y = 8 - px;
+			break;
+		case 1:
+			x = 10 + px;
+			y = py;
+			break;
+		default:
+			return NULL;
+	}
+
+	if (val >= 0)
+	{
+		res = malloc (sizeof (button_evt));
+		// printf ("%d, %d, %d\n", x, y, val);
+		res->p.x = x;
+		res->p.y = y;
+		res->v = val;
+	}
+
+	return res;
+}
+
+static int output_old[19][9];
+
+void update_output (void)
+{
+	int x, y;
+	int px, py;
+	int color;
+	int pad;
+
+	for (x=0; x<19; x++) for (y=0; y<9; y++)
+	{
+		if (output[x][y] != output_old[x][y])
+		{
+			output_old[x][y] = color = output[x][y];
+
+			pad = x > 9;
+
+			switch (pad)
+			{
+				case 0:
+					px = 8 - y;
+					py = x;
+					break;
+				case 1:
+					px = x - 10;
+					py = y;
+					break;
+			}
+
+			if (py == 0 && px >= 0 && px <= 7)
+			{
+				snd_seq_ev_set_controller (&aev, 0, 104+px, color);
+			}
+			else if (py >= 1 && py <= 8 && px >= 0 && px <= 8)
+			{
+				snd_seq_ev_set_noteon (&aev, 0, (py-1)*16+px, color);
+			}
+			else continue;
+
+			snd_seq_ev_set_source (&aev, ports[pad]);
+			snd_seq_event_output (seq, &aev);
+		}
+	}
+
+	// Quick hack to reconnect buggy keypads...
+	snd_seq_connect_from (seq, ports[0], 20 + 4 * 0, 0);
+	snd_seq_connect_to   (seq, ports[0], 20 + 4 * 0, 0);
+	snd_seq_connect_from (seq, ports[1], 20 + 4 * 1, 0);
+	snd_seq_connect_to   (seq, ports[1], 20 + 4 * 1, 0);
+
+	snd_seq_drain_output (seq);
+}
+
+void put_color (coord p, int c)
+{
+	output[p.x][p.y] = c;
+}
+
+// Pages come in banks of 8, one per button on the right side. The page
+// shown is yellow and the others in use are green; (6,0) and (7,0) go to
+// the previous and next bank, and are lit when there are instances there.
+void display_pages (void)
+{
+	int used[8];
+	int before, after;
+	int bank, page, i, y;
+
+	bank = inst_page / 8;
+	before = after = 0;
+	bzero (used, sizeof (used));
+
+	for (i = 0; i < num_insts; i++)
+	{
+		page = inst_list[i].p.y / 8;
+		if (page / 8 < bank)
+			before = 1;
+		else if (page / 8 > bank)
+			after = 1;
+		else
+			used[page % 8] = 1;
+	}
+
+	for (y=0; y<8; y++)
+		output[18][y+1] = used[y] ? C_GREEN : C_BLACK;
+
+	output[18][inst_page%8+1] = C_YELLOW;
+	output[6][0] = before ? C_GREEN : C_BLACK;
+	output[7][0] = after ? C_GREEN : C_BLACK;
+}
+
+void display_editor (void)
+{
+	int x, y;
+
+	for (x=0; x<8; x++) for (y=0; y<8; y++)
+	{
+		if (comp_table[x][y].empty)
+			output[x+1][y+1] = C_BLACK;
+		else
+			output[x+1][y+1] = C_GREEN;
+	}
+
+	for (x=0; x<8; x++) for (y=0; y<8; y++)
+	{
+		if (inst_at ((coord) {x, y+inst_page*8}) == NULL)
+			output[x+10][y+1] = C_BLACK;
+		else
+			output[x+10][y+1] = C_GREEN;
+	}
+
+	display_pages();
+}
+
+// Utility mode: instances colored by their average cost over the last second
+void display_profile (void)
+{
+	instance *inst;
+	double share;
+	int x, y;
+
+	for (x=0; x<8; x++) for (y=0; y<8; y++)
+	{
+		inst = inst_at ((coord) {x, y+inst_page*8});
+		share = inst ? inst->prof.last_avg / prof_budget() : 0;
+
+		if (inst == NULL)
+			output[x+10][y+1] = C_BLACK;
+		else if (share < 0.01)
+			output[x+10][y+1] = C_GREEN;
+		else if (share < 0.05)
+			output[x+10][y+1] = C_YELLOW;
+		else if (share < 0.2)
+			output[x+10][y+1] = C_ORANGE;
+		else
+			output[x+10][y+1] = C_RED;
+	}
+
+	display_pages();
+}
+
+//==============================================================================
+// ALSA interface (MIDI and audio)
+
+int audio_ok = 0;
+snd_pcm_t *handle;
+
+void user_init (void)
+{
+	int res;
+	int pad;
+	char *name;
+
+	// MIDI
+	snd_seq_open (&seq, "default", SND_SEQ_OPEN_DUPLEX, 0);
+	snd_seq_set_client_name (seq, "Stacy");
+	snd_seq_nonblock (seq, 1);
+
+	snd_seq_ev_set_fixed  (&aev);
+	snd_seq_ev_set_direct (&aev);
+	snd_seq_ev_set_dest   (&aev, SND_SEQ_ADDRESS_SUBSCRIBERS, 0);
+
+	name = malloc (42);
+
+	for (pad=0; pad<2; pad++)
+	{
+		sprintf (name, "Array %d", pad);
+
+		ports[pad] = snd_seq_create_simple_port (seq, name, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE | SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+
+		snd_seq_connect_from (seq, ports[pad], 20 + 4 * pad, 0);
+		snd_seq_connect_to   (seq, ports[pad], 20 + 4 * pad, 0);
+
+		// Reset Launchpad
+		snd_seq_ev_set_controller (&aev, 0, 0, 0);
+		snd_seq_ev_set_source (&aev, ports[pad]);
+		snd_seq_event_output (seq, &aev);
 	}
 
 	// Audio
 	snd_pcm_hw_params_t *params;
+	snd_pcm_uframes_t frames, buffer;
+	unsigned int rate, channels;
+
+	res = snd_pcm_open (&handle, "hw:0,0", SND_PCM_STREAM_PLAYBACK, 0);
+
+	if (res == 0)
+	{
+		snd_pcm_hw_params_alloca (&params);
+
+		snd_pcm_hw_params_any (handle, params);
+		snd_pcm_hw_params_set_access (handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+		snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+		channels = out_channels;
+		snd_pcm_hw_params_set_channels_near (handle, params, &channels);
+		rate = srate;
+		frames = psize;
+		buffer = psize * 4;
+		snd_pcm_hw_params_set_rate_near (handle, params, &rate, 0);
+		snd_pcm_hw_params_set_period_size_near (handle, params, &frames, 0);
+		snd_pcm_hw_params_set_buffer_size_near (handle, params, &buffer);
+		snd_pcm_hw_params (handle, params);
+
+		// Use whatever the card settled on
+		snd_pcm_hw_params_get_rate (params, &rate, 0);
+		snd_pcm_hw_params_get_period_size (params, &frames, 0);
+		snd_pcm_hw_params_get_channels (params, &channels);
+		if (rate != srate || frames != psize || channels != out_channels)
+			printf ("ALSA: %u Hz, %lu frames per period, %u channels\n", rate, frames, channels);
+		srate = rate;
+		set_period_size (frames);
+
+		// Periods are interleaved for out_channels, so the card has to agree
+		if (channels < 1 || channels > MAX_CHANNELS)
+		{
+			printf ("Warning: ALSA wants %u channels, at most %d are supported.\n", channels, MAX_CHANNELS);
+			snd_pcm_close (handle);
+			return;
+		}
+		out_channels = channels;
+
+		audio_ok = 1;
+	}
+	else
+	{
+		puts ("Warning: could not initialize ALSA audio.");
+	}
+}
+
+//==============================================================================
+// Audio thread
+//
+// The audio thread only moves finished periods from a ring to ALSA, so that
+// a slow period of the graph or a burst of MIDI events eats into the
+// run-ahead instead of turning into an xrun. The ring has a single producer
+// (the main loop) and a single consumer (the audio thread) and is lock-free;
+// the semaphore only counts free slots, so that the main loop can sleep
+// while it's ahead.
+
+#define RING_SIZE 16
+
+signed short ring[RING_SIZE][MAX_CHANNELS*MAX_PSIZE];
+volatile unsigned int ring_in = 0, ring_out = 0;
+sem_t ring_space;
+int run_ahead = 2;
+
+unsigned long xruns = 0;		// ALSA ran out of samples
+unsigned long late_periods = 0;		// The ring was empty, silence was played
+
+void *audio_thread (void *arg)
+{
+	static signed short silent[MAX_CHANNELS*MAX_PSIZE];
+	signed short *samples;
+	int a, res, queued;
+
+	// Pre-fill the ring before starting the stream
+	while (__atomic_load_n (&ring_in, __ATOMIC_ACQUIRE) < run_ahead)
+		usleep (1000);
+
+	for (;;)
+	{
+		queued = __atomic_load_n (&ring_in, __ATOMIC_ACQUIRE) != ring_out;
+
+		if (queued)
+			samples = ring[ring_out % RING_SIZE];
+		else
+		{
+			samples = silent;
+			__sync_add_and_fetch (&late_periods, 1);
+		}
+
+		if (audio_ok)
+		{
+			a = psize;
+			while (a > 0)
+			{
+				res = snd_pcm_writei (handle, samples, a);	// Blocking
+				if (res == -EAGAIN)
+					continue;
+				if (res < 0)
+				{
+					if (res == -EPIPE)
+					{
+						__sync_add_and_fetch (&xruns, 1);
+						snd_pcm_prepare (handle);
+						snd_pcm_writei (handle, samples, a);
+						snd_pcm_writei (handle, samples, a);
+						break;
+					}
+					else
+					{
+						printf("Bleh: %s\n", snd_strerror (res));
+						exit (1);
+					}
+				}
+				a -= res;
+			}
+		}
+		else
+		{
+			usleep (1000000 * psize / srate);
+		}
 
-	res = snd_pcm_open (&handle, "hw:0,0", SND_PCM_STREAM_PLAYBACK, 0);
+		if (queued)
+		{
+			__atomic_store_n (&ring_out, ring_out + 1, __ATOMIC_RELEASE);
+			sem_post (&ring_space);
+		}
+	}
 
-	if (res == 0)
-	{
-		snd_pcm_hw_params_alloca (&params);
+	return NULL;
+}
 
-		snd_pcm_hw_params_any (handle, params);
-		snd_pcm_hw_params_set_access (handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
-		snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
-		snd_pcm_hw_params_set_channels (handle, params, 2);
-		snd_pcm_hw_params_set_rate (handle, params, SAMPLE_RATE, 0);
-		snd_pcm_hw_params_set_period_size (handle, params, PSIZE, 0);
-		snd_pcm_hw_params_set_buffer_size (handle, params, PSIZE*4);
-		snd_pcm_hw_params (handle, params);
+void audio_init (void)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	pthread_t thread;
 
-		audio_ok = 1;
-	}
-	else
+	sem_init (&ring_space, 0, run_ahead);
+
+	pthread_attr_init (&attr);
+	pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+	param.sched_priority = sched_get_priority_max (SCHED_FIFO);
+	pthread_attr_setschedparam (&attr, &param);
+
+	if (pthread_create (&thread, &attr, audio_thread, NULL) != 0)
 	{
-		puts ("Warning: could not initialize ALSA audio.");
+		puts ("Warning: no real-time priority for the audio thread.");
+		pthread_create (&thread, NULL, audio_thread, NULL);
 	}
+
+	pthread_attr_destroy (&attr);
 }
 
-void user_process_audio (void)
+// Convert the current output to interleaved 16-bit samples. The signal's
+// channels are dealt round-robin to the output channels, so that a mono
+// signal plays on all of them.
+void output_period (signed short *samples)
 {
-	sig_audio l,r;
-	signed short samples[2*PSIZE];
-	int a;
-	int res;
-	static double time = 0;
-	sig_audio *input;
+	signed short plane[MAX_PSIZE];
+	sig_audio ramp[MAX_PSIZE];
 	sig_head *px;
+	int a, c;
 
-	input = silence;
+	px = sig_error();
 
-	if (sig_table[7][0] != NULL && sig_table[7][0]->type == SIG_PAIR)
+	if (sig_at ((coord) {7, 0})->type == SIG_PAIR)
 	{
-		px = (sig_table[7][0] + 1);
-		if (px->type == SIG_AUDIO)
-		{
-			input = (sig_audio *) (px + 1);
-		}
+		px = sig_elem (sig_at ((coord) {7, 0}), 0);
 	}
 
-	for (a = 0; a < PSIZE; a++)
+	for (c = 0; c < out_channels; c++)
 	{
-		l = input[a];
-		r = l;
-
-		time += 1.0/SAMPLE_RATE;
-
 		// FIXME: why is my waveform upside-down?
-		l *= -0.2;
-		r *= -0.2;
+		vec_to_s16 (plane, audio_plane (px, c, ramp), -0.2f, psize);
 
-		if (l < -1) l = -1;
-		if (r < -1) r = -1;
-		if (l > 1) l = 1;
-		if (r > 1) r = 1;
-
-		samples[2*a] = (signed short) (l * 32767);
-		samples[2*a+1] = (signed short) (r * 32767);
+		for (a = 0; a < psize; a++)
+			samples[a*out_channels + c] = plane[a];
 	}
+}
 
-	if (audio_ok)
-	{
-		a = PSIZE;
-		while (a > 0)
-		{
-			res = snd_pcm_writei (handle, samples, a);	// Blocking
-			if (res == -EAGAIN)
-				continue;
-			if (res < 0)
-			{
-				if (res == -EPIPE)
-				{
-					printf ("xrun\n");
-					snd_pcm_prepare (handle);
-					snd_pcm_writei (handle, samples, a);
-					snd_pcm_writei (handle, samples, a);
-					break;
-				}
-				else
-				{
-					printf("Bleh: %s\n", snd_strerror (res));
-					exit (1);
-				}
-			}
-			a -= res;
-		}
-	}
-	else
+// Queue the current output for the audio thread (blocks while we're ahead)
+void user_process_audio (void)
+{
+	sem_wait (&ring_space);
+	output_period (ring[ring_in % RING_SIZE]);
+	__atomic_store_n (&ring_in, ring_in + 1, __ATOMIC_RELEASE);
+}
+
+void report_xruns (void)
+{
+	static unsigned long old_xruns = 0, old_late = 0;
+
+	if (xruns != old_xruns || late_periods != old_late)
 	{
-		usleep (1000);
+		printf ("xruns: %lu, late periods: %lu\n", xruns, late_periods);
+		old_xruns = xruns;
+		old_late = late_periods;
 	}
 }
 
@@ -512,34 +1889,24 @@ void user_display_arrays (void)
 	sig_head *px;
 	int x, y;
 
-	arr1 = empty_array;
-	arr2 = empty_array;
+	arr1 = 0;
+	arr2 = 0;
 
-	if (sig_table[7][0] != NULL && sig_table[7][0]->type == SIG_PAIR)
+	if (sig_at ((coord) {7, 0})->type == SIG_PAIR)
 	{
-		px = sig_table[7][0] + 1;
-		px = ((void *) px) + px->size;
+		px = sig_elem (sig_at ((coord) {7, 0}), 1);
 
 		if (px->type == SIG_PAIR)
 		{
-			px = px + 1;
-			if (px->type == SIG_UI)
-			{
-				arr1 = (void *) (px + 1);
-			}
-
-			px = ((void *) px) + px->size;
-			if (px->type == SIG_UI)
-			{
-				arr2 = (void *) (px + 1);
-			}
+			arr1 = ui_of (sig_elem (px, 0));
+			arr2 = ui_of (sig_elem (px, 1));
 		}
 	}
 
 	for (x=0; x<8; x++) for (y=0; y<8; y++)
 	{
-		output[x+1][y+1] = arr2[x][y]?C_GREEN:C_BLACK;
-		output[x+10][y+1] = arr1[x][y]?C_GREEN:C_BLACK;
+		output[x+1][y+1] = UI_CELL (arr2, x, y)?C_GREEN:C_BLACK;
+		output[x+10][y+1] = UI_CELL (arr1, x, y)?C_GREEN:C_BLACK;
 	}
 
 	for (y=0; y<8; y++)
@@ -553,7 +1920,7 @@ sig_head *op_identity (sig_head *in[], void **state)
 {
 	sig_head *out;
 
-	out = sig_dup (in[0]);
+	out = sig_ref (in[0]);
 
 	return out;
 }
@@ -585,7 +1952,7 @@ sig_head *op_delay (sig_head *in[], void **state)
 	ds = *state;
 
 	out = ds->buf[ds->pos];
-	ds->buf[ds->pos] = sig_dup (in[0]);
+	ds->buf[ds->pos] = sig_ref (in[0]);
 
 	ds->pos++;
 	if (ds->pos >= DELAY)
@@ -594,6 +1961,16 @@ sig_head *op_delay (sig_head *in[], void **state)
 	return out;
 }
 
+// The signals still waiting to come out
+void delay_free (void *state)
+{
+	delay_state *ds = state;
+	int a;
+
+	for (a = 0; a < DELAY; a++)
+		sig_unref (ds->buf[a]);
+}
+
 sig_head *op_delay_sync (sig_head *in[], void **state)
 {
 	sig_head *out;
@@ -612,10 +1989,12 @@ sig_head *op_delay_sync (sig_head *in[], void **state)
 
 	ds = *state;
 
+	// Each reference is handed out exactly once per cycle: the slots
+	// refilled here have all been returned since the last refill.
 	out = ds->buf[ds->pos];
 	if (ds->pos == 0)
 		for (a = 0; a < DELAY; a++)
-			ds->buf[a] = sig_dup (in[0]);
+			ds->buf[a] = sig_ref (in[0]);
 
 	ds->pos++;
 	if (ds->pos >= DELAY)
@@ -624,32 +2003,40 @@ sig_head *op_delay_sync (sig_head *in[], void **state)
 	return out;
 }
 
+// Slot 0, refilled after being handed out, and those not handed out yet
+void delay_sync_free (void *state)
+{
+	delay_state *ds = state;
+	int a;
+
+	sig_unref (ds->buf[0]);
+	for (a = ds->pos > 0 ? ds->pos : DELAY; a < DELAY; a++)
+		sig_unref (ds->buf[a]);
+}
+
 //==============================================================================
 // Cartesian product components (AKA "ordered pair", "multiplexer")
 
 sig_head *op_pair (sig_head *in[], void **state)
 {
-	sig_head *e1, *e2, *out;
+	sig_head **e, *out;
 	int size;
 
-	e1 = in[0];
-	e2 = in[1];
-
-	size = sizeof (sig_head) + e1->size + e2->size;
-	out = malloc (size);
+	size = sizeof (sig_head) + 2 * sizeof (sig_head *);
+	out = sig_alloc (size);
 	out->type = SIG_PAIR;
 	out->size = size;
 
-	memcpy (((void *) out) + sizeof (sig_head), e1, e1->size);
-	memcpy (((void *) out) + sizeof (sig_head) + e1->size, e2, e2->size);
+	e = (void *) (out + 1);
+	e[0] = sig_ref (in[0]);
+	e[1] = sig_ref (in[1]);
 
 	return out;
 }
 
 sig_head *op_elem1 (sig_head *in[], void **state)
 {
-	sig_head *px, *out;
-	int size;
+	sig_head *out;
 
 	if (in[0]->type != SIG_PAIR)
 	{
@@ -657,8 +2044,7 @@ sig_head *op_elem1 (sig_head *in[], void **state)
 	}
 	else
 	{
-		px = (((void *) in[0]) + sizeof (sig_head));
-		out = sig_dup (px);
+		out = sig_ref (sig_elem (in[0], 0));
 	}
 
 	return out;
@@ -666,8 +2052,7 @@ sig_head *op_elem1 (sig_head *in[], void **state)
 
 sig_head *op_elem2 (sig_head *in[], void **state)
 {
-	sig_head *px, *out;
-	int size;
+	sig_head *out;
 
 	if (in[0]->type != SIG_PAIR)
 	{
@@ -675,9 +2060,7 @@ sig_head *op_elem2 (sig_head *in[], void **state)
 	}
 	else
 	{
-		px = ((void *) in[0]) + sizeof (sig_head);
-		px = ((void *) px) + px->size;
-		out = sig_dup (px);
+		out = sig_ref (sig_elem (in[0], 1));
 	}
 
 	return out;
@@ -686,65 +2069,527 @@ sig_head *op_elem2 (sig_head *in[], void **state)
 //==============================================================================
 // Audio components
 
-signed short *sample;
-int s_size = 0;
+// Sample playback
+//
+// Sample files are mapped rather than read, so that startup doesn't wait
+// for them and they don't have to fit in memory: the kernel pages them in
+// as they are played, and every voice asks for the next SAMPLE_AHEAD
+// frames in advance so that this happens before we get there.
+//
+// Slot 0 is Data/sample.raw (or Data/sample0.wav), slot n Data/sample<n>.wav
+// (or .raw). Raw files are 16-bit stereo, WAV files 16-bit PCM, mono or
+// stereo.
+
+#define MAX_SAMPLES 64
+#define SAMPLE_AHEAD 65536	// Frames
+
+typedef struct
+{
+	void *map;		// Whole file, NULL if the slot is empty
+	size_t map_size;
+	signed short *data;	// First frame
+	long frames;
+	int channels;
+	int rate;
+} sample_slot;
+
+sample_slot sample_slots[MAX_SAMPLES];
+long page_size;
+
+unsigned long get_le (unsigned char *p, int bytes)
+{
+	unsigned long v;
+
+	v = 0;
+	while (bytes--)
+		v = (v << 8) | p[bytes];
+
+	return v;
+}
+
+// Find the format and the samples in a RIFF file
+int wav_parse (sample_slot *ss)
+{
+	unsigned char *p, *end;
+	unsigned long len;
+	int format, bits;
+
+	p = ss->map;
+	end = p + ss->map_size;
+
+	if (ss->map_size < 12 || memcmp (p, "RIFF", 4) != 0 || memcmp (p + 8, "WAVE", 4) != 0)
+		return 0;
+
+	format = 0;
+	bits = 0;
+
+	for (p += 12; p + 8 <= end; p += 8 + len + (len & 1))
+	{
+		len = get_le (p + 4, 4);
+		if (len > end - p - 8)
+			len = end - p - 8;
+
+		if (memcmp (p, "fmt ", 4) == 0 && len >= 16)
+		{
+			format = get_le (p + 8, 2);
+			ss->channels = get_le (p + 10, 2);
+			ss->rate = get_le (p + 12, 4);
+			bits = get_le (p + 22, 2);
+		}
+		else if (memcmp (p, "data", 4) == 0)
+		{
+			if (format != 1 || bits != 16 || ss->channels < 1 || ss->channels > 2)
+				return 0;
+
+			ss->data = (void *) (p + 8);
+			ss->frames = len / (2 * ss->channels);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int sample_load (int n, char *name)
+{
+	sample_slot *ss;
+	struct stat st;
+	int fd, len;
+
+	ss = &sample_slots[n];
+
+	fd = open (name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (fstat (fd, &st) < 0 || st.st_size == 0)
+	{
+		close (fd);
+		return 0;
+	}
+
+	ss->map_size = st.st_size;
+	ss->map = mmap (NULL, ss->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (ss->map == MAP_FAILED)
+	{
+		ss->map = NULL;
+		return 0;
+	}
+
+	len = strlen (name);
+	if (len >= 4 && strcmp (name + len - 4, ".raw") == 0)
+	{
+		ss->data = ss->map;
+		ss->frames = ss->map_size / 4;
+		ss->channels = 2;
+		ss->rate = srate;
+	}
+	else if (! wav_parse (ss))
+	{
+		printf ("Warning: %s is not a 16-bit PCM WAV file\n", name);
+		munmap (ss->map, ss->map_size);
+		ss->map = NULL;
+		return 0;
+	}
+
+	madvise (ss->map, ss->map_size, MADV_SEQUENTIAL);
+
+	return 1;
+}
+
+void playback_init (void)
+{
+	char name[64];
+	int n;
+
+	page_size = sysconf (_SC_PAGESIZE);
+
+	if (! sample_load (0, "Data/sample.raw") && ! sample_load (0, "Data/sample0.wav"))
+		puts ("Warning: could not load Data/sample.raw");
+
+	for (n = 1; n < MAX_SAMPLES; n++)
+	{
+		sprintf (name, "Data/sample%d.wav", n);
+		if (sample_load (n, name))
+			continue;
+
+		sprintf (name, "Data/sample%d.raw", n);
+		sample_load (n, name);
+	}
+}
+
+// Ask for the next SAMPLE_AHEAD frames once we're halfway through the
+// previous request. 'ahead' is where the voice's requests stop.
+void sample_prefetch (sample_slot *ss, long pos, long *ahead)
+{
+	unsigned long from, to;
+
+	if (pos < *ahead - SAMPLE_AHEAD / 2 || *ahead >= ss->frames)
+		return;
+
+	if (*ahead < pos)
+		*ahead = pos;
+
+	from = (unsigned long) (ss->data + *ahead * ss->channels);
+	*ahead += SAMPLE_AHEAD;
+	if (*ahead > ss->frames)
+		*ahead = ss->frames;
+	to = (unsigned long) (ss->data + *ahead * ss->channels);
+
+	from &= ~(page_size - 1);
+	madvise ((void *) from, to - from, MADV_WILLNEED);
+}
+
+sig_audio sample_channel (sample_slot *ss, long pos, int c)
+{
+	return (sig_audio) ss->data[pos * ss->channels + c % ss->channels] / 32768;
+}
+
+typedef struct
+{
+	long pos;
+	long ahead;
+} playback_state;
+
+// Slot 0, looped, with as many channels as the file
+sig_head *op_playback (sig_head *in[], void **state)
+{
+	sig_head *out;
+	playback_state *ds;
+	sample_slot *ss;
+	sig_t_audio s;
+	int a, c;
+
+	if (! *state)
+	{
+		*state = malloc (sizeof (playback_state));
+		ds = *state;
+		ds->pos = 0;
+		ds->ahead = 0;
+	}
+
+	ds = *state;
+	ss = &sample_slots[0];
+
+	if (! ss->map)
+	{
+		out = sig_new_audio (1);
+		bzero (out + 1, psize * sizeof (sig_audio));
+		return out;
+	}
+
+	out = sig_new_audio (ss->channels);
+	s = (void *) (out + 1);
+
+	sample_prefetch (ss, ds->pos, &ds->ahead);
+
+	for (a = 0; a < psize; a++)
+	{
+		for (c = 0; c < ss->channels; c++)
+			s[c * psize + a] = sample_channel (ss, ds->pos, c);
+		ds->pos++;
+		if (ds->pos >= ss->frames)
+		{
+			ds->pos = 0;
+			ds->ahead = 0;
+			sample_prefetch (ss, ds->pos, &ds->ahead);
+		}
+	}
+
+	return out;
+}
+
+typedef struct
+{
+	char pressed[64];
+	playback_state voice[64];	// Position -1 when silent
+} sampler_state;
+
+// One slot per button, played from the start when the button is pressed.
+// The output is stereo, mono samples playing on both sides.
+sig_head *op_sampler (sig_head *in[], void **state)
+{
+	sig_head *out;
+	sampler_state *ds;
+	playback_state *v;
+	sample_slot *ss;
+	sig_t_ui s_in;
+	sig_t_audio s;
+	int a, n, x, y;
+
+	if (! *state)
+	{
+		*state = malloc (sizeof (sampler_state));
+		ds = *state;
+		bzero (ds->pressed, sizeof (ds->pressed));
+		for (n = 0; n < 64; n++)
+			ds->voice[n].pos = -1;
+	}
+
+	ds = *state;
+
+	s_in = ui_of (in[0]);
+
+	out = sig_new_audio (2);
+	s = (void *) (out + 1);
+	bzero (s, 2 * psize * sizeof (sig_audio));
+
+	for (x=0; x<8; x++) for (y=0; y<8; y++)
+	{
+		n = x*8+y;
+		if (UI_CELL (s_in, x, y) && ! ds->pressed[n] && sample_slots[n].map)
+		{
+			ds->voice[n].pos = 0;
+			ds->voice[n].ahead = 0;
+		}
+		ds->pressed[n] = UI_CELL (s_in, x, y);
+	}
+
+	for (n = 0; n < 64; n++)
+	{
+		v = &ds->voice[n];
+		if (v->pos < 0)
+			continue;
+
+		ss = &sample_slots[n];
+		sample_prefetch (ss, v->pos, &v->ahead);
+
+		for (a = 0; a < psize && v->pos < ss->frames; a++, v->pos++)
+		{
+			s[a] += sample_channel (ss, v->pos, 0);
+			s[psize + a] += sample_channel (ss, v->pos, 1);
+		}
+
+		if (v->pos >= ss->frames)
+			v->pos = -1;
+	}
+
+	return out;
+}
+
+// Variable-speed playback
+//
+// Slot 0 again, looped, with as many channels as the file, at exp() of the
+// input times the ratio between the file's rate and ours. The speed input is
+// audio, followed frame by frame, or control, like the synthesizers' pitch.
+// Samples are interpolated with libpolyseg's windowed-sinc kernel, a
+// precomputed row of taps per sub-sample phase. Above the native speed, the
+// kernel is stretched by the speed so that what lies above the new Nyquist
+// frequency is filtered out instead of folding back. Its rows are then built
+// for STRETCH_PHASES phases and kept as long as the speed holds; while it
+// varies, taps are computed sample by sample.
+
+#define MAX_SPEED 4
+#define SPAN_HALF (OSC_SINC_HALF * MAX_SPEED)
+#define STRETCH_PHASES 64
+#define SPAN_LEN (MAX_SPEED * MAX_PSIZE + 2 * SPAN_HALF + 3)
+
+typedef struct
+{
+	double pos;	// In frames of the sample
+	long ahead;
+	double speed;	// Of the stretched rows, 0 if none yet
+	int taps;	// Per row
+	float rows[STRETCH_PHASES][2 * SPAN_HALF];
+	double speeds[MAX_PSIZE];	// Of every frame of the period
+	float span[2][SPAN_LEN];	// Frames around the period, per channel
+} varispeed_state;
+
+// Stretched kernel at x, x + dx, x + dx * 2... in table points
+float stretch_taps (float *w, int n, float x, float dx)
+{
+	const float *kernel;
+	float f, sum;
+	int k, i;
+
+	kernel = osc_sinc_table();
+
+	sum = 0;
+	for (k = 0; k < n; k++)
+	{
+		f = fabsf (x + k * dx);
+		i = f;
+		f -= i;
+		w[k] = kernel[i] + (kernel[i+1] - kernel[i]) * f;
+		sum += w[k];
+	}
+
+	return sum;
+}
+
+// Rows for samples -taps/2+1 to taps/2 around a point p/STRETCH_PHASES past
+// sample 0, with a gain of 1
+void stretch_rows (varispeed_state *ds, double speed)
+{
+	float dx, sum;
+	int p, k;
+
+	ds->speed = speed;
+	ds->taps = 2 * ceil (OSC_SINC_HALF * speed);
+	dx = OSC_SINC_PHASES / speed;
+
+	for (p = 0; p < STRETCH_PHASES; p++)
+	{
+		sum = stretch_taps (ds->rows[p], ds->taps,
+			(1 - ds->taps / 2 - (float) p / STRETCH_PHASES) * dx, dx);
+
+		for (k = 0; k < ds->taps; k++)
+			ds->rows[p][k] /= sum;
+	}
+}
+
+sig_head *op_varispeed (sig_head *in[], void **state)
+{
+	sig_head *out;
+	varispeed_state *ds;
+	sample_slot *ss;
+	sig_t_audio s, s_speed;
+	sig_t_control c_speed;
+	float w[2 * SPAN_HALF + 1];
+	const float *row;
+	float dx, sum;
+	int a, c, n, p, len;
+	long base, first, last, i0, k;
+
+	double start, end, step, ratio, speed, pos, total;
+	int fixed;
+
+	if (! *state)
+	{
+		*state = malloc (sizeof (varispeed_state));
+		ds = *state;
+		ds->pos = 0;
+		ds->ahead = 0;
+		ds->speed = 0;
+	}
+
+	ds = *state;
+	ss = &sample_slots[0];
+
+	if (! ss->map)
+	{
+		out = sig_new_audio (1);
+		bzero (out + 1, psize * sizeof (sig_audio));
+		return out;
+	}
+
+	out = sig_new_audio (ss->channels);
+	s = (void *) (out + 1);
+
+	// Speed of every frame, ramping across the period for a control
+	ratio = (double) ss->rate / srate;
+	if (in[0]->type == SIG_AUDIO)
+	{
+		s_speed = (void *) (in[0] + 1);
+		for (a = 0; a < psize; a++)
+			ds->speeds[a] = fmin (ratio * exp (s_speed[a]), MAX_SPEED);
+	}
+	else
+	{
+		start = end = 0;
+		if (in[0]->type == SIG_CONTROL)
+		{
+			c_speed = (void *) (in[0] + 1);
+			start = c_speed->start;
+			end = c_speed->end;
+		}
+
+		start = fmin (ratio * exp (start), MAX_SPEED);
+		end = fmin (ratio * exp (end), MAX_SPEED);
+		step = (end - start) / psize;
+
+		speed = start;
+		for (a = 0; a < psize; a++)
+		{
+			ds->speeds[a] = speed;
+			speed += step;
+		}
+	}
+
+	total = 0;
+	fixed = 1;
+	for (a = 0; a < psize; a++)
+	{
+		total += ds->speeds[a];
+		if (ds->speeds[a] != ds->speeds[0])
+			fixed = 0;
+	}
 
-void playback_init (void)
-{
-	FILE *f;
+	if (fixed && ds->speeds[0] > 1 && ds->speeds[0] != ds->speed)
+		stretch_rows (ds, ds->speeds[0]);
 
-	f = fopen ("Data/sample.raw", "r");
+	sample_prefetch (ss, ds->pos, &ds->ahead);
 
-	if (f == NULL)
+	// Every frame the period's kernels will see, converted once
+	base = floor (ds->pos) - SPAN_HALF;
+	n = total + 2 * SPAN_HALF + 3;
+	for (a = 0; a < n; a++)
 	{
-		puts ("Warning: could not load Data/sample.raw");
-		s_size = 1024;
-		sample = malloc (s_size * 4);
-		bzero (sample, s_size * 4);
-		return;
+		k = (base + a) % ss->frames;
+		if (k < 0)
+			k += ss->frames;
+		for (c = 0; c < ss->channels; c++)
+			ds->span[c][a] = sample_channel (ss, k, c);
 	}
 
-	fseek (f, 0L, SEEK_END);
-	s_size = ftell (f) / 4;
-	fseek(f, 0L, SEEK_SET);
-
-	sample = malloc (s_size * 4);
+	pos = ds->pos;
+	for (a = 0; a < psize; a++)
+	{
+		speed = ds->speeds[a];
+		i0 = floor (pos);
+		sum = 1;
 
-	fread (sample, 1, s_size*4, f);
+		if (speed <= 1)
+		{
+			p = lrint ((pos - i0) * OSC_SINC_PHASES);
+			if (p == OSC_SINC_PHASES)
+			{
+				i0++;
+				p = 0;
+			}
 
-	fclose (f);
-}
+			row = osc_sinc_row (p);
+			first = i0 - OSC_SINC_HALF + 1;
+			len = 2 * OSC_SINC_HALF;
+		}
+		else if (fixed)
+		{
+			p = lrint ((pos - i0) * STRETCH_PHASES);
+			if (p == STRETCH_PHASES)
+			{
+				i0++;
+				p = 0;
+			}
 
-sig_head *op_playback (sig_head *in[], void **state)
-{
-	sig_head *out;
-	sig_t_audio s;
-	int *pos;
-	int size;
-	int a;
+			row = ds->rows[p];
+			first = i0 - ds->taps / 2 + 1;
+			len = ds->taps;
+		}
+		else
+		{
+			first = ceil (pos - OSC_SINC_HALF * speed);
+			last = floor (pos + OSC_SINC_HALF * speed);
+			dx = OSC_SINC_PHASES / speed;
 
-	if (! *state)
-	{
-		*state = malloc (sizeof (int));
-		pos = *state;
-		*pos = 0;
-	}
+			len = last - first + 1;
+			sum = stretch_taps (w, len, (first - pos) * dx, dx);
+			row = w;
+		}
 
-	size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-	out = malloc (size);
-	out->type = SIG_AUDIO;
-	out->size = size;
+		for (c = 0; c < ss->channels; c++)
+			s[c * psize + a] = vec_dot (row, ds->span[c] + (first - base), len) / sum;
 
-	pos = *state;
-	s = (void *) (out + 1);
+		pos += speed;
+	}
 
-	for (a = 0; a < PSIZE; a++)
+	if (pos >= ss->frames)
 	{
-		s[a] = (sig_audio) sample[*pos] / 32768;
-		*pos += 2;
-		if (*pos >= s_size * 2)
-			*pos = 0;
+		pos = fmod (pos, ss->frames);
+		ds->ahead = 0;
 	}
+	ds->pos = pos;
 
 	return out;
 }
@@ -752,24 +2597,27 @@ sig_head *op_playback (sig_head *in[], void **state)
 sig_head *op_attenuate (sig_head *in[], void **state)
 {
 	sig_head *out;
-	sig_t_audio s_out;
+	sig_t_audio s_in, s_out;
+	sig_t_control c_in;
 	int size;
-	int a;
 
-	if (in[0]->type != SIG_AUDIO)
+	if (in[0]->type == SIG_CONTROL)
+	{
+		c_in = (void *) (in[0] + 1);
+		out = sig_new_control (0.7f * c_in->start, 0.7f * c_in->end);
+	}
+	else if (in[0]->type != SIG_AUDIO)
 	{
 		out = sig_error();
 	}
 	else
 	{
-		out = sig_dup (in[0]);
+		out = sig_new_like (in[0]);
 
+		s_in = (void *) (in[0] + 1);
 		s_out = (void *) (out + 1);
 
-		for (a = 0; a < PSIZE; a++)
-		{
-			s_out[a] = s_out[a] * 0.7;
-		}
+		vec_scale (s_out, s_in, 0.7f, out->frames * out->channels);
 	}
 
 	return out;
@@ -778,24 +2626,28 @@ sig_head *op_attenuate (sig_head *in[], void **state)
 sig_head *op_saturate (sig_head *in[], void **state)
 {
 	sig_head *out;
-	sig_t_audio s_out;
+	sig_t_audio s_in, s_out;
+	sig_t_control c_in;
 	int size;
-	int a;
 
-	if (in[0]->type != SIG_AUDIO)
+	if (in[0]->type == SIG_CONTROL)
+	{
+		// Slow enough for a ramp between the two ends to be close
+		c_in = (void *) (in[0] + 1);
+		out = sig_new_control (sin (c_in->start), sin (c_in->end));
+	}
+	else if (in[0]->type != SIG_AUDIO)
 	{
 		out = sig_error();
 	}
 	else
 	{
-		out = sig_dup (in[0]);
+		out = sig_new_like (in[0]);
 
+		s_in = (void *) (in[0] + 1);
 		s_out = (void *) (out + 1);
 
-		for (a = 0; a < PSIZE; a++)
-		{
-			s_out[a] = sin (s_out[a]);
-		}
+		vec_sin (s_out, s_in, out->frames * out->channels);
 	}
 
 	return out;
@@ -804,24 +2656,27 @@ sig_head *op_saturate (sig_head *in[], void **state)
 sig_head *op_inverse (sig_head *in[], void **state)
 {
 	sig_head *out;
-	sig_t_audio s_out;
+	sig_t_audio s_in, s_out;
+	sig_t_control c_in;
 	int size;
-	int a;
 
-	if (in[0]->type != SIG_AUDIO)
+	if (in[0]->type == SIG_CONTROL)
+	{
+		c_in = (void *) (in[0] + 1);
+		out = sig_new_control (-c_in->start, -c_in->end);
+	}
+	else if (in[0]->type != SIG_AUDIO)
 	{
 		out = sig_error();
 	}
 	else
 	{
-		out = sig_dup (in[0]);
+		out = sig_new_like (in[0]);
 
+		s_in = (void *) (in[0] + 1);
 		s_out = (void *) (out + 1);
 
-		for (a = 0; a < PSIZE; a++)
-		{
-			s_out[a] = 0.0 - (s_out[a]);
-		}
+		vec_scale (s_out, s_in, -1.0f, out->frames * out->channels);
 	}
 
 	return out;
@@ -831,37 +2686,35 @@ sig_head *op_add (sig_head *in[], void **state)
 {
 	sig_head *out;
 	sig_t_audio s_in1, s_in2, s_out;
+	sig_audio ramp1[MAX_PSIZE], ramp2[MAX_PSIZE];
 	sig_t_bytebeat ss_in1, ss_in2, ss_out;
+	sig_t_control c_in1, c_in2;
 	int size;
-	int a;
+	int a, c;
 
 	if (in[0]->type == SIG_AUDIO || in[1]->type == SIG_AUDIO)
 	{
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
-		out->type = SIG_AUDIO;
-		out->size = size;
+		// Mono is spread over the other side's channels
+		c = audio_channels (in[0]);
+		if (audio_channels (in[1]) > c)
+			c = audio_channels (in[1]);
 
+		out = sig_new_audio (c);
 		s_out = (void *) (out + 1);
-		if (in[0]->type == SIG_AUDIO)
-			s_in1 = (void *) (in[0] + 1);
-		else
-			s_in1 = silence;
-		if (in[1]->type == SIG_AUDIO)
-			s_in2 = (void *) (in[1] + 1);
-		else
-			s_in2 = silence;
 
-		for (a = 0; a < PSIZE; a++)
+		for (c = 0; c < out->channels; c++)
 		{
-			s_out[a] = s_in1[a] + s_in2[a];
+			s_in1 = audio_plane (in[0], c, ramp1);
+			s_in2 = audio_plane (in[1], c, ramp2);
+			vec_add (s_out + c * psize, s_in1, s_in2, psize);
 		}
 	}
 	else if (in[0]->type == SIG_BYTEBEAT || in[1]->type == SIG_BYTEBEAT)
 	{
-		size = sizeof (sig_head) + BB_SIZE * sizeof (int);
-		out = malloc (size);
+		size = sizeof (sig_head) + bb_size * sizeof (int);
+		out = sig_alloc (size);
 		out->type = SIG_BYTEBEAT;
+		out->frames = bb_size;
 		out->size = size;
 
 		ss_out = (void *) (out + 1);
@@ -874,11 +2727,17 @@ sig_head *op_add (sig_head *in[], void **state)
 		else
 			ss_in2 = silence_bb;
 
-		for (a = 0; a < BB_SIZE; a++)
+		for (a = 0; a < bb_size; a++)
 		{
 			ss_out[a] = ss_in1[a] + ss_in2[a];
 		}
 	}
+	else if (in[0]->type == SIG_CONTROL || in[1]->type == SIG_CONTROL)
+	{
+		c_in1 = control_of (in[0]);
+		c_in2 = control_of (in[1]);
+		out = sig_new_control (c_in1->start + c_in2->start, c_in1->end + c_in2->end);
+	}
 	else
 		out = sig_error();
 
@@ -889,37 +2748,35 @@ sig_head *op_mult (sig_head *in[], void **state)
 {
 	sig_head *out;
 	sig_t_audio s_in1, s_in2, s_out;
+	sig_audio ramp1[MAX_PSIZE], ramp2[MAX_PSIZE];
 	sig_t_bytebeat ss_in1, ss_in2, ss_out;
+	sig_t_control c_in1, c_in2;
 	int size;
-	int a;
+	int a, c;
 
 	if (in[0]->type == SIG_AUDIO || in[1]->type == SIG_AUDIO)
 	{
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
-		out->type = SIG_AUDIO;
-		out->size = size;
+		// Mono is spread over the other side's channels
+		c = audio_channels (in[0]);
+		if (audio_channels (in[1]) > c)
+			c = audio_channels (in[1]);
 
+		out = sig_new_audio (c);
 		s_out = (void *) (out + 1);
-		if (in[0]->type == SIG_AUDIO)
-			s_in1 = (void *) (in[0] + 1);
-		else
-			s_in1 = silence;
-		if (in[1]->type == SIG_AUDIO)
-			s_in2 = (void *) (in[1] + 1);
-		else
-			s_in2 = silence;
 
-		for (a = 0; a < PSIZE; a++)
+		for (c = 0; c < out->channels; c++)
 		{
-			s_out[a] = s_in1[a] * s_in2[a];
+			s_in1 = audio_plane (in[0], c, ramp1);
+			s_in2 = audio_plane (in[1], c, ramp2);
+			vec_mult (s_out + c * psize, s_in1, s_in2, psize);
 		}
 	}
 	else if (in[0]->type == SIG_BYTEBEAT || in[1]->type == SIG_BYTEBEAT)
 	{
-		size = sizeof (sig_head) + BB_SIZE * sizeof (int);
-		out = malloc (size);
+		size = sizeof (sig_head) + bb_size * sizeof (int);
+		out = sig_alloc (size);
 		out->type = SIG_BYTEBEAT;
+		out->frames = bb_size;
 		out->size = size;
 
 		ss_out = (void *) (out + 1);
@@ -932,11 +2789,19 @@ sig_head *op_mult (sig_head *in[], void **state)
 		else
 			ss_in2 = silence_bb;
 
-		for (a = 0; a < BB_SIZE; a++)
+		for (a = 0; a < bb_size; a++)
 		{
 			ss_out[a] = ss_in1[a] * ss_in2[a];
 		}
 	}
+	else if (in[0]->type == SIG_CONTROL || in[1]->type == SIG_CONTROL)
+	{
+		// Only exact if one of them is constant, the product of two
+		// ramps being a parabola, but close enough for slow signals.
+		c_in1 = control_of (in[0]);
+		c_in2 = control_of (in[1]);
+		out = sig_new_control (c_in1->start * c_in2->start, c_in1->end * c_in2->end);
+	}
 	else
 		out = sig_error();
 
@@ -948,8 +2813,8 @@ sig_head *op_mult (sig_head *in[], void **state)
 
 typedef struct
 {
-	double ay;
-	double bx, by;
+	double ay[MAX_CHANNELS];
+	double bx[MAX_CHANNELS], by[MAX_CHANNELS];
 } eq_state;
 
 sig_head *op_equalizer (sig_head *in[], void **state)
@@ -957,63 +2822,217 @@ sig_head *op_equalizer (sig_head *in[], void **state)
 	sig_head *out;
 
 	sig_t_audio s_in, s_out;
-	sig_audio b_in[PSIZE], b_low[PSIZE], b_high[PSIZE];
+	sig_audio b_in[MAX_PSIZE], b_low[MAX_PSIZE], b_high[MAX_PSIZE];
 	eq_state *ds;
-	int size;
-	int a;
+	int a, c;
 
 	if (! *state)
 	{
 		*state = malloc (sizeof (eq_state));
 		ds = *state;
-		ds->ay = 0;
-		ds->bx = 0;
-		ds->by = 0;
+		bzero (ds, sizeof (eq_state));
 	}
 
 	ds = *state;
-	if (in[0]->type != SIG_AUDIO)
+	if (in[0]->type != SIG_AUDIO && in[0]->type != SIG_CONTROL)
 	{
 		out = sig_error();
-		ds->ay = 0;
-		ds->bx = 0;
-		ds->by = 0;
+		bzero (ds, sizeof (eq_state));
 	}
 	else
 	{
-		out = sig_dup (in[0]);
-		s_in  = (void *) (in[0] + 1);
-		s_out = (void *) (out + 1);
+		out = sig_new_audio (audio_channels (in[0]));
 
-		for (a = 0; a < PSIZE; a++)
+		for (c = 0; c < out->channels; c++)
 		{
-			b_in[a] = s_in[a] * 0.5;
-		}
+			s_in  = audio_plane (in[0], c, b_in);
+			s_out = (sig_t_audio) (out + 1) + c * psize;
 
-		b_low[0] = b_in[0] * LOW_SHELF + ds->ay * (1 - LOW_SHELF);
-		for (a = 1; a < PSIZE; a++)
-		{
-			b_low[a] = b_in[a] * LOW_SHELF + b_low[a-1] * (1 - LOW_SHELF);
-		}
-		ds->ay = b_low[a-1];
+			for (a = 0; a < psize; a++)
+			{
+				b_in[a] = s_in[a] * 0.5;
+			}
 
-		b_high[0] = HIGH_SHELF * ds->by + HIGH_SHELF * (b_in[0] - ds->bx);
-		for (a = 1; a < PSIZE; a++)
-		{
-			b_high[a] = HIGH_SHELF * b_high[a-1] + HIGH_SHELF * (b_in[a] - b_in[a-1]);
-		}
-		ds->bx = b_in[a-1];
-		ds->by = b_high[a-1];
+			b_low[0] = b_in[0] * LOW_SHELF + ds->ay[c] * (1 - LOW_SHELF);
+			for (a = 1; a < psize; a++)
+			{
+				b_low[a] = b_in[a] * LOW_SHELF + b_low[a-1] * (1 - LOW_SHELF);
+			}
+			ds->ay[c] = b_low[a-1];
 
-		for (a = 0; a < PSIZE; a++)
-		{
-			s_out[a] = b_low[a] * 13.5 + b_high[a] * 3;
+			b_high[0] = HIGH_SHELF * ds->by[c] + HIGH_SHELF * (b_in[0] - ds->bx[c]);
+			for (a = 1; a < psize; a++)
+			{
+				b_high[a] = HIGH_SHELF * b_high[a-1] + HIGH_SHELF * (b_in[a] - b_in[a-1]);
+			}
+			ds->bx[c] = b_in[a-1];
+			ds->by[c] = b_high[a-1];
+
+			for (a = 0; a < psize; a++)
+			{
+				s_out[a] = b_low[a] * 13.5 + b_high[a] * 3;
+			}
 		}
 	}
 
 	return out;
 }
 
+// Equal-power panning of a mono signal (or a mix of all of its channels)
+// into stereo. The position goes from -1 (left) to 1 (right), and ramps
+// along with a control input.
+sig_head *op_pan (sig_head *in[], void **state)
+{
+	sig_head *out;
+	sig_t_audio s_in, s_out, s_pos;
+	sig_audio ramp[MAX_PSIZE];
+	sig_t_control c_pos;
+	int a;
+
+	double start, end, l, r, dl, dr;
+
+	if (in[0]->type != SIG_AUDIO && in[0]->type != SIG_CONTROL)
+		return sig_error();
+
+	start = end = 0;
+	if (in[1]->type == SIG_CONTROL)
+	{
+		c_pos = (void *) (in[1] + 1);
+		start = c_pos->start;
+		end = c_pos->end;
+	}
+	else if (in[1]->type == SIG_AUDIO)
+	{
+		s_pos = (void *) (in[1] + 1);
+		start = end = s_pos[0];
+	}
+
+	start = (fmin (fmax (start, -1), 1) + 1) * M_PI / 4;
+	end = (fmin (fmax (end, -1), 1) + 1) * M_PI / 4;
+
+	// Gains at both ends of the period, in between they're interpolated
+	l = cos (start);
+	r = sin (start);
+	dl = (cos (end) - l) / psize;
+	dr = (sin (end) - r) / psize;
+
+	s_in = audio_samples (in[0], ramp);
+
+	out = sig_new_audio (2);
+	s_out = (void *) (out + 1);
+
+	for (a = 0; a < psize; a++)
+	{
+		s_out[a] = s_in[a] * l;
+		s_out[psize + a] = s_in[a] * r;
+		l += dl;
+		r += dr;
+	}
+
+	return out;
+}
+
+// Delay line
+//
+// A circular buffer of samples, allocated once, long enough for the longest
+// delay. The length is LINE_DEFAULT times the exponential of the second
+// input (audio or control, like the synthesizers' pitch), in between two
+// samples it is interpolated linearly. A ramping length is followed sample
+// by sample, which bends the pitch like a tape would.
+
+#define LINE_SECONDS 4
+#define LINE_DEFAULT 0.25
+
+typedef struct
+{
+	sig_audio *buf;
+	int mask;	// Buffer length minus one, a power of two
+	int pos;	// Next sample to write
+} line_state;
+
+void line_free (void *state)
+{
+	line_state *ds = state;
+
+	free (ds->buf);
+}
+
+sig_head *op_delay_line (sig_head *in[], void **state)
+{
+	sig_head *out;
+	line_state *ds;
+	sig_t_audio s_in, s_out, s_len;
+	sig_audio ramp[MAX_PSIZE];
+	sig_t_control c_len;
+	int size;
+	int a, n, d;
+
+	double start, end, step, max, len, frac;
+
+	if (! *state)
+	{
+		*state = malloc (sizeof (line_state));
+		ds = *state;
+
+		n = 1;
+		while (n < LINE_SECONDS * srate + MAX_PSIZE)
+			n *= 2;
+
+		ds->buf = malloc (n * sizeof (sig_audio));
+		bzero (ds->buf, n * sizeof (sig_audio));
+		ds->mask = n - 1;
+		ds->pos = 0;
+	}
+
+	ds = *state;
+
+	// Length at both ends of the period, in samples
+	start = end = 0;
+	if (in[1]->type == SIG_CONTROL)
+	{
+		c_len = (void *) (in[1] + 1);
+		start = c_len->start;
+		end = c_len->end;
+	}
+	else if (in[1]->type == SIG_AUDIO)
+	{
+		s_len = (void *) (in[1] + 1);
+		start = end = s_len[0];
+	}
+
+	max = LINE_SECONDS * srate;
+	start = fmin (fmax (LINE_DEFAULT * srate * exp (start), 0), max);
+	end = fmin (fmax (LINE_DEFAULT * srate * exp (end), 0), max);
+	step = (end - start) / psize;
+
+	// Keeps running on silence, so that the tail isn't cut
+	s_in = audio_samples (in[0], ramp);
+
+	size = sizeof (sig_head) + psize * sizeof (sig_audio);
+	out = sig_alloc (size);
+	out->type = SIG_AUDIO;
+	out->frames = psize;
+	out->size = size;
+
+	s_out = (void *) (out + 1);
+
+	len = start;
+	for (a = 0; a < psize; a++)
+	{
+		ds->buf[ds->pos] = s_in[a];
+
+		d = len;
+		frac = len - d;
+		s_out[a] = ds->buf[(ds->pos - d) & ds->mask] * (1 - frac)
+			+ ds->buf[(ds->pos - d - 1) & ds->mask] * frac;
+
+		ds->pos = (ds->pos + 1) & ds->mask;
+		len += step;
+	}
+
+	return out;
+}
+
 //==============================================================================
 // Bytebeat components
 
@@ -1034,26 +3053,28 @@ sig_head *op_bb_time (sig_head *in[], void **state)
 
 	time = *state;
 
-	size = sizeof (sig_head) + BB_SIZE * sizeof (int);
-	out = malloc (size);
+	size = sizeof (sig_head) + bb_size * sizeof (int);
+	out = sig_alloc (size);
 	out->type = SIG_BYTEBEAT;
+	out->frames = bb_size;
 	out->size = size;
 
 	s_out = (void *) (out + 1);
 
-	for (a = 0; a < BB_SIZE; a++)
+	for (a = 0; a < bb_size; a++)
 	{
-		s_out[a] = *time;
-		*time = *time + 1;
+		s_out[a] = *time + a;
 	}
 
+	*time = *time + bb_steps;
+
 	return out;
 }
 
 sig_head *op_bb_rshift (sig_head *in[], void **state)
 {
 	sig_head *out;
-	sig_t_bytebeat s_out;
+	sig_t_bytebeat s_in, s_out;
 	int size;
 	int a;
 
@@ -1063,13 +3084,14 @@ sig_head *op_bb_rshift (sig_head *in[], void **state)
 	}
 	else
 	{
-		out = sig_dup (in[0]);
+		out = sig_new_like (in[0]);
 
+		s_in = (void *) (in[0] + 1);
 		s_out = (void *) (out + 1);
 
-		for (a = 0; a < BB_SIZE; a++)
+		for (a = 0; a < bb_size; a++)
 		{
-			s_out[a] = s_out[a] >> 1;
+			s_out[a] = s_in[a] >> 1;
 		}
 	}
 
@@ -1079,7 +3101,7 @@ sig_head *op_bb_rshift (sig_head *in[], void **state)
 sig_head *op_bb_not (sig_head *in[], void **state)
 {
 	sig_head *out;
-	sig_t_bytebeat s_out;
+	sig_t_bytebeat s_in, s_out;
 	int size;
 	int a;
 
@@ -1089,13 +3111,14 @@ sig_head *op_bb_not (sig_head *in[], void **state)
 	}
 	else
 	{
-		out = sig_dup (in[0]);
+		out = sig_new_like (in[0]);
 
+		s_in = (void *) (in[0] + 1);
 		s_out = (void *) (out + 1);
 
-		for (a = 0; a < BB_SIZE; a++)
+		for (a = 0; a < bb_size; a++)
 		{
-			s_out[a] = ~ s_out[a];
+			s_out[a] = ~ s_in[a];
 		}
 	}
 
@@ -1116,9 +3139,10 @@ sig_head *op_bb_or (sig_head *in[], void **state)
 	}
 	else
 	{
-		size = sizeof (sig_head) + PSIZE * sizeof (int);
-		out = malloc (size);
+		size = sizeof (sig_head) + bb_size * sizeof (int);
+		out = sig_alloc (size);
 		out->type = SIG_BYTEBEAT;
+		out->frames = bb_size;
 		out->size = size;
 
 		s_out = (void *) (out + 1);
@@ -1131,7 +3155,7 @@ sig_head *op_bb_or (sig_head *in[], void **state)
 		else
 			s_in2 = silence_bb;
 
-		for (a = 0; a < BB_SIZE; a++)
+		for (a = 0; a < bb_size; a++)
 		{
 			s_out[a] = s_in1[a] | s_in2[a];
 		}
@@ -1154,9 +3178,10 @@ sig_head *op_bb_and (sig_head *in[], void **state)
 	}
 	else
 	{
-		size = sizeof (sig_head) + BB_SIZE * sizeof (int);
-		out = malloc (size);
+		size = sizeof (sig_head) + bb_size * sizeof (int);
+		out = sig_alloc (size);
 		out->type = SIG_BYTEBEAT;
+		out->frames = bb_size;
 		out->size = size;
 
 		s_out = (void *) (out + 1);
@@ -1169,7 +3194,7 @@ sig_head *op_bb_and (sig_head *in[], void **state)
 		else
 			s_in2 = silence_bb;
 
-		for (a = 0; a < BB_SIZE; a++)
+		for (a = 0; a < bb_size; a++)
 		{
 			s_out[a] = s_in1[a] & s_in2[a];
 		}
@@ -1192,9 +3217,10 @@ sig_head *op_bb_xor (sig_head *in[], void **state)
 	}
 	else
 	{
-		size = sizeof (sig_head) + PSIZE * sizeof (int);
-		out = malloc (size);
+		size = sizeof (sig_head) + bb_size * sizeof (int);
+		out = sig_alloc (size);
 		out->type = SIG_BYTEBEAT;
+		out->frames = bb_size;
 		out->size = size;
 
 		s_out = (void *) (out + 1);
@@ -1207,7 +3233,7 @@ sig_head *op_bb_xor (sig_head *in[], void **state)
 		else
 			s_in2 = silence_bb;
 
-		for (a = 0; a < BB_SIZE; a++)
+		for (a = 0; a < bb_size; a++)
 		{
 			s_out[a] = s_in1[a] ^ s_in2[a];
 		}
@@ -1224,14 +3250,15 @@ sig_head *op_bb_onetwentyeight (sig_head *in[], void **state)
 	int a;
 	int i1, i2, o;
 
-	size = sizeof (sig_head) + BB_SIZE * sizeof (int);
-	out = malloc (size);
+	size = sizeof (sig_head) + bb_size * sizeof (int);
+	out = sig_alloc (size);
 	out->type = SIG_BYTEBEAT;
+	out->frames = bb_size;
 	out->size = size;
 
 	s_out = (void *) (out + 1);
 
-	for (a = 0; a < BB_SIZE; a++)
+	for (a = 0; a < bb_size; a++)
 	{
 		s_out[a] = 128;
 	}
@@ -1269,27 +3296,26 @@ sig_head *op_bb_slider (sig_head *in[], void **state)
 
 	ds = *state;
 
-	size = sizeof (sig_head) + BB_SIZE * sizeof (int);
-	out = malloc (size);
+	size = sizeof (sig_head) + bb_size * sizeof (int);
+	out = sig_alloc (size);
 	out->type = SIG_BYTEBEAT;
+	out->frames = bb_size;
 	out->size = size;
 
 	s_out = (void *) (out + 1);
-	if (in[0]->type == SIG_UI)
-		s_in = (void *) (in[0] + 1);
-	else s_in = empty_array;
+	s_in = ui_of (in[0]);
 
-	if (s_in[0][0] == 1 && ds->old_plus == 0)
+	if (UI_CELL (s_in, 0, 0) && ds->old_plus == 0)
 		ds->value += 1;
-	if (s_in[0][1] == 1 && ds->old_minus == 0)
+	if (UI_CELL (s_in, 0, 1) && ds->old_minus == 0)
 		ds->value -= 1;
 
-	ds->old_plus = s_in[0][0];
-	ds->old_minus = s_in[0][1];
+	ds->old_plus = UI_CELL (s_in, 0, 0);
+	ds->old_minus = UI_CELL (s_in, 0, 1);
 
 	value = ds->value;
 
-	for (a = 0; a < BB_SIZE; a++)
+	for (a = 0; a < bb_size; a++)
 	{
 		s_out[a] = value;
 	}
@@ -1297,14 +3323,76 @@ sig_head *op_bb_slider (sig_head *in[], void **state)
 	return out;
 }
 
-sig_head *op_bb_audio (sig_head *in[], void **state)
+// Each step of the bytebeat is queued as a step segment on a libpolyseg
+// stream, which renders it with bandlimited edges instead of holding the
+// value over whole samples. The steps of a period are heard OSC_SINC_HALF
+// samples late, as far as the renderer looks ahead.
+typedef struct
+{
+	osc_stream *stream;
+	osc_clock time;
+	int value;
+} bb_audio_state;
+
+sig_head *bb_render (void **state, const int *values)
 {
 	sig_head *out;
+	bb_audio_state *ds;
 	sig_t_audio s_out;
-	sig_t_bytebeat s_in;
+	osc_segdef seg;
 	int size;
-	int a, b;
-	sig_audio sample;
+	int a, v;
+
+	if (! *state)
+	{
+		*state = malloc (sizeof (bb_audio_state));
+		ds = *state;
+		ds->stream = osc_new_stream();
+		ds->time = 0;
+		ds->value = 128;
+	}
+
+	ds = *state;
+
+	size = sizeof (sig_head) + psize * sizeof (sig_audio);
+	out = sig_alloc (size);
+	out->type = SIG_AUDIO;
+	out->frames = psize;
+	out->size = size;
+
+	s_out = (void *) (out + 1);
+
+	seg.p1 = 0;
+	seg.p2 = 0;
+	for (a = 0; a < bb_steps; a++)
+	{
+		v = values[a] & 0xff;
+		if (v == ds->value)
+			continue;
+
+		seg.time = ds->time + (OSC_SINC_HALF + (bb_phase + (double) a * srate) / bb_rate) / srate;
+		seg.p0 = (((osc_funcparm) v) / 256.0 * 2 - 1) * OSC_CUTOFF;
+		osc_update_stream (ds->stream, seg);
+		ds->value = v;
+	}
+
+	osc_render_stream (ds->stream, psize, s_out);
+	ds->time += (double) psize / srate;
+
+	return out;
+}
+
+// The stream, with the steps it hasn't rendered yet
+void bb_audio_free (void *state)
+{
+	bb_audio_state *ds = state;
+
+	osc_free_stream (ds->stream);
+}
+
+sig_head *op_bb_audio (sig_head *in[], void **state)
+{
+	sig_head *out;
 
 	if (in[0]->type != SIG_BYTEBEAT)
 	{
@@ -1312,897 +3400,1258 @@ sig_head *op_bb_audio (sig_head *in[], void **state)
 	}
 	else
 	{
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
-		out->type = SIG_AUDIO;
-		out->size = size;
+		out = bb_render (state, (void *) (in[0] + 1));
+	}
 
-		s_out = (void *) (out + 1);
-		s_in = (void *) (in[0] + 1);
+	return out;
+}
+
+//==============================================================================
+// Bytebeat fusion
+//
+// A formula like (t>>1)|(t&128) takes one instance per operator, each with
+// its own buffer and its own trip through the scheduler. When the schedule
+// is rebuilt, the bytebeat operators feeding an op_bb_audio are folded into
+// a small stack program, which that instance then runs over the period
+// with no buffer in between, straight into its audio output. The folded
+// instances aren't evaluated anymore.
+//
+// An operator is only folded if everything reading it is folded into the
+// same program: its output isn't needed anywhere else. Anything else the
+// expression reads (sliders, shared operators, the timeline at (0,0), the
+// output at (7,0)...) is a leaf, read from its buffer as usual.
+
+// Signals read outside the graph: the timeline and the output
+int fuse_exported (coord c)
+{
+	return (c.x == 0 || c.x == 7) && c.y == 0;
+}
+
+// Who reads each instance, and where it stands in the schedule
+typedef struct
+{
+	int *idx;
+	int *rd_start;
+	int *rd_list;
+} fuse_info;
+
+void fuse_scan (fuse_info *fi)
+{
+	int *fill;
+	instance *inst;
+	int a, i, j;
+
+	fi->idx = malloc ((num_insts + 1) * sizeof (int));
+	fi->rd_start = calloc (num_insts + 1, sizeof (int));
+	fi->rd_list = malloc ((MAX_COMP_ARGS * num_insts + 1) * sizeof (int));
+	fill = malloc ((num_insts + 1) * sizeof (int));
+
+	for (i = 0; i < num_insts; i++)
+		fi->idx[i] = -1;
+	for (i = 0; i < schedule_len; i++)
+		fi->idx[schedule[i]] = i;
 
-		for (a = 0; a < BB_SIZE; a++)
+	for (i = 0; i < num_insts; i++)
+	{
+		inst = &inst_list[i];
+		for (a = 0; a < inst->c.num_inputs; a++)
+			if (inst->src[a] >= 0)
+				fi->rd_start[inst->src[a] + 1]++;
+	}
+	for (i = 0; i < num_insts; i++)
+	{
+		fi->rd_start[i+1] += fi->rd_start[i];
+		fill[i] = fi->rd_start[i];
+	}
+	for (i = 0; i < num_insts; i++)
+	{
+		inst = &inst_list[i];
+		for (a = 0; a < inst->c.num_inputs; a++)
 		{
-			sample = ((sig_audio) (s_in[a] & 0xff)) / 256.0 * 2 - 1;
-			for (b = 0; b < BB_OVERSAMPLE; b++)
-			{
-				s_out[a*BB_OVERSAMPLE+b] = sample;
-			}
+			j = inst->src[a];
+			if (j >= 0)
+				fi->rd_list[fill[j]++] = i;
 		}
 	}
 
-	return out;
+	free (fill);
 }
 
-//==============================================================================
-// UI components
+void fuse_free (fuse_info *fi)
+{
+	free (fi->idx);
+	free (fi->rd_start);
+	free (fi->rd_list);
+}
 
-sig_head *op_array_1 (sig_head *in[], void **state)
+// Keep only the candidates nothing outside the expression at 'root' reads,
+// and that were evaluated before it anyway: one reading the root itself is
+// read a period late.
+void fuse_prune (fuse_info *fi, int root, char *member)
 {
-	sig_head *out;
-	sig_t_ui s;
-	int size;
-	int x, y;
+	int r, a, i, changed;
 
-	size = sizeof (sig_head) + 8 * sizeof (char[8]);
-	out = malloc (size);
-	out->type = SIG_UI;
-	out->size = size;
+	do
+	{
+		changed = 0;
+		for (i = 0; i < num_insts; i++)
+		{
+			if (! member[i])
+				continue;
+
+			if (fi->idx[i] > fi->idx[root])
+			{
+				member[i] = 0;
+				changed = 1;
+				continue;
+			}
+
+			for (a = fi->rd_start[i]; a < fi->rd_start[i+1]; a++)
+			{
+				r = fi->rd_list[a];
+				if (! member[r] && r != root)
+				{
+					member[i] = 0;
+					changed = 1;
+					break;
+				}
+			}
+		}
+	} while (changed);
+}
 
-	s = (void *) (out + 1);
+// Folded instances leave the schedule and drop their last output
+void fuse_drop (char *absorbed)
+{
+	instance *inst;
+	int a, i;
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
+	i = 0;
+	for (a = 0; a < schedule_len; a++)
 	{
-		s[x][y] = input[x+10][y+1];
-	}
+		if (! absorbed[schedule[a]])
+		{
+			schedule[i++] = schedule[a];
+			continue;
+		}
 
-	return out;
+		inst = &inst_list[schedule[a]];
+		sig_unref (inst->out);
+		inst->out = sig_error();
+		inst->gen++;
+	}
+	schedule_len = i;
 }
 
-sig_head *op_array_2 (sig_head *in[], void **state)
+enum { BB_NOP, BB_LOAD, BB_TIME, BB_128, BB_SHR, BB_NOT, BB_OR, BB_AND, BB_XOR };
+
+int bb_opcode (compop op)
 {
-	sig_head *out;
-	sig_t_ui s;
-	int size;
-	int x, y;
+	if (op == op_bb_time)
+		return BB_TIME;
+	if (op == op_bb_onetwentyeight)
+		return BB_128;
+	if (op == op_bb_rshift)
+		return BB_SHR;
+	if (op == op_bb_not)
+		return BB_NOT;
+	if (op == op_bb_or)
+		return BB_OR;
+	if (op == op_bb_and)
+		return BB_AND;
+	if (op == op_bb_xor)
+		return BB_XOR;
+
+	return -1;
+}
 
-	size = sizeof (sig_head) + 8 * sizeof (char[8]);
-	out = malloc (size);
-	out->type = SIG_UI;
-	out->size = size;
+// Instances that may be folded, reachable from 'c'
+void bb_gather (int c, char *member)
+{
+	instance *inst;
+	int a;
 
-	s = (void *) (out + 1);
+	if (c < 0 || member[c] || bb_absorbed[c])
+		return;
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
-	{
-		s[x][y] = input[x+1][y+1];
-	}
+	inst = &inst_list[c];
+	if (bb_opcode (inst->c.op) < 0 || fuse_exported (inst->p))
+		return;
 
-	return out;
+	member[c] = 1;
+	for (a = 0; a < inst->c.num_inputs; a++)
+		bb_gather (inst->src[a], member);
 }
 
-sig_head *op_ctrl1 (sig_head *in[], void **state)
+int bb_emit (bb_prog *pg, int op, int arg, int push, int *sp)
 {
-	sig_head *out;
-	sig_t_ui s;
-	int size;
-	int x, y;
-
-	// FIXME: need to handle variable arrays
-	size = sizeof (sig_head) + 8 * sizeof (char[8]);
-	out = malloc (size);
-	out->type = SIG_UI;
-	out->size = size;
-
-	s = (void *) (out + 1);
+	if (pg->len >= BB_MAX_CODE || arg < 0)
+		return 0;
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
-	{
-		s[x][y] = 0;
-	}
+	*sp += push;
+	if (*sp > BB_STACK)
+		return 0;
 
-	s[0][0] = input[10][0];
-	s[0][1] = input[11][0];
+	pg->code[pg->len] = op;
+	pg->arg[pg->len] = arg;
+	pg->len++;
 
-	return out;
+	return 1;
 }
 
-sig_head *op_ctrl2 (sig_head *in[], void **state)
+int bb_leaf (bb_prog *pg, int c)
 {
-	sig_head *out;
-	sig_t_ui s;
-	int size;
-	int x, y;
-
-	// FIXME: need to handle variable arrays
-	size = sizeof (sig_head) + 8 * sizeof (char[8]);
-	out = malloc (size);
-	out->type = SIG_UI;
-	out->size = size;
-
-	s = (void *) (out + 1);
+	int a;
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
-	{
-		s[x][y] = 0;
-	}
+	for (a = 0; a < pg->num_leaves; a++)
+		if (pg->leaves[a] == c)
+			return a;
 
-	s[0][0] = input[12][0];
-	s[0][1] = input[13][0];
+	if (pg->num_leaves == BB_MAX_LEAVES)
+		return -1;
 
-	return out;
+	pg->leaves[pg->num_leaves] = c;
+	return pg->num_leaves++;
 }
 
-sig_head *op_ctrl3 (sig_head *in[], void **state)
+int bb_clock (bb_prog *pg, int c)
 {
-	sig_head *out;
-	sig_t_ui s;
-	int size;
-	int x, y;
+	instance *inst;
+	int a;
 
-	// FIXME: need to handle variable arrays
-	size = sizeof (sig_head) + 8 * sizeof (char[8]);
-	out = malloc (size);
-	out->type = SIG_UI;
-	out->size = size;
+	for (a = 0; a < pg->num_clocks; a++)
+		if (pg->clock_at[a] == c)
+			return a;
 
-	s = (void *) (out + 1);
+	if (pg->num_clocks == BB_MAX_LEAVES)
+		return -1;
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
+	// Same counter as op_bb_time, so that unfolding doesn't restart it
+	inst = &inst_list[c];
+	if (! inst->state)
 	{
-		s[x][y] = 0;
+		inst->state = malloc (sizeof (int));
+		*(int *) inst->state = 0;
 	}
 
-	s[0][0] = input[14][0];
-	s[0][1] = input[15][0];
-
-	return out;
+	pg->clock_at[pg->num_clocks] = c;
+	pg->clocks[pg->num_clocks] = inst->state;
+	return pg->num_clocks++;
 }
 
-sig_head *op_ctrl4 (sig_head *in[], void **state)
+// Postfix code for the expression at 'c'. Shared operators are computed
+// again for each reader, cycles give up.
+int bb_compile (bb_prog *pg, int c, char *member, char *path, int *sp)
 {
-	sig_head *out;
-	sig_t_ui s;
-	int size;
-	int x, y;
+	instance *inst;
+	int op, a, ok;
 
-	// FIXME: need to handle variable arrays
-	size = sizeof (sig_head) + 8 * sizeof (char[8]);
-	out = malloc (size);
-	out->type = SIG_UI;
-	out->size = size;
+	if (c < 0 || ! member[c])
+		return bb_emit (pg, BB_LOAD, bb_leaf (pg, c), 1, sp);
 
-	s = (void *) (out + 1);
+	if (path[c])
+		return 0;
+	path[c] = 1;
 
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
-	{
-		s[x][y] = 0;
-	}
+	inst = &inst_list[c];
+	ok = 1;
+	for (a = 0; a < inst->c.num_inputs && ok; a++)
+		ok = bb_compile (pg, inst->src[a], member, path, sp);
 
-	s[0][0] = input[16][0];
-	s[0][1] = input[17][0];
+	path[c] = 0;
 
-	return out;
+	if (! ok)
+		return 0;
+
+	op = bb_opcode (inst->c.op);
+	switch (op)
+	{
+		case BB_TIME:
+			return bb_emit (pg, op, bb_clock (pg, c), 1, sp);
+		case BB_128:
+			return bb_emit (pg, op, 0, 1, sp);
+		case BB_SHR:
+		case BB_NOT:
+			return bb_emit (pg, op, 0, 0, sp);
+		default:
+			return bb_emit (pg, op, 0, -1, sp);
+	}
 }
 
-sig_head *op_mirror (sig_head *in[], void **state)
+void bb_fuse (void)
 {
-	sig_head *out;
-	sig_t_ui s_in, s_out;
-	int size;
-	int x, y;
+	fuse_info fi;
+	char *member, *path;
+	instance *inst;
+	bb_prog *pg;
+	int c, p, i, j, sp;
 
-	if (in[0]->type != SIG_UI)
+	for (i = 0; i < bb_fused_len; i++)
+		free (bb_fused[i]);
+
+	bb_fused_len = num_insts;
+	bb_fused = realloc (bb_fused, (num_insts + 1) * sizeof (bb_prog *));
+	bb_absorbed = realloc (bb_absorbed, num_insts + 1);
+	for (i = 0; i < num_insts; i++)
 	{
-		out = sig_error();
+		bb_fused[i] = NULL;
+		bb_absorbed[i] = 0;
 	}
-	else
-	{
-		size = sizeof (sig_head) + 8 * sizeof (char[8]);
-		out = malloc (size);
-		out->type = SIG_UI;
-		out->size = size;
 
-		s_out = (void *) (out + 1);
-		s_in = (void *) (in[0] + 1);
+	if (! bb_fusion)
+		return;
 
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
+	fuse_scan (&fi);
+	member = malloc (num_insts + 1);
+	path = calloc (num_insts + 1, 1);
+
+	for (i = 0; i < schedule_len; i++)
+	{
+		p = schedule[i];
+		inst = &inst_list[p];
+		if (inst->c.op != op_bb_audio)
+			continue;
+
+		bzero (member, num_insts);
+		bb_gather (inst->src[0], member);
+		fuse_prune (&fi, p, member);
+
+		c = inst->src[0];
+		if (c < 0 || ! member[c])
+			continue;
+
+		pg = calloc (1, sizeof (bb_prog));
+		sp = 0;
+		if (! bb_compile (pg, c, member, path, &sp))
 		{
-			s_out[x][y] = s_in[7-x][y];
+			free (pg);
+			continue;
 		}
+
+		bb_fused[p] = pg;
+		for (j = 0; j < num_insts; j++)
+			if (member[j])
+				bb_absorbed[j] = 1;
 	}
 
-	return out;
-}
+	free (member);
+	free (path);
+	fuse_free (&fi);
 
-typedef struct
-{
-	char in[8][8];	// sig_t_ui
-	char out[8][8];	// sig_t_ui
-} toggle_state;
+	fuse_drop (bb_absorbed);
+}
 
-sig_head *op_toggle (sig_head *in[], void **state)
+sig_head *bb_run (int p)
 {
-	sig_head *out;
-	toggle_state *ds;
-	sig_t_ui s_in, s_out;
-	int size;
-	int x, y;
-
-	if (! *state)
+	sig_head *out, *s;
+	bb_prog *pg;
+	sig_t_bytebeat leaf[BB_MAX_LEAVES];
+	char code[BB_MAX_CODE];
+	int valid[BB_STACK];
+	int st[BB_STACK][BB_BLOCK];
+	int values[MAX_BB_SIZE];
+	int *src, *x, *y;
+	int a, b, i, n, t, sp;
+
+	pg = bb_fused[p];
+
+	// Whether the result is a bytebeat at all, as the components would
+	// have decided one by one: anything else reads as silence, and gives
+	// an error unless OR'ed (AND'ed, XOR'ed) with a bytebeat. An error
+	// stays silence through a NOT, which is dropped.
+	sp = 0;
+	for (i = 0; i < pg->len; i++)
 	{
-		*state = malloc (sizeof (toggle_state));
-		ds = *state;
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
-			ds->in[x][y] = ds->out[x][y] = 0;
+		code[i] = pg->code[i];
+		switch (code[i])
+		{
+			case BB_LOAD:
+				s = sig_of (pg->leaves[(int) pg->arg[i]]);
+				valid[sp++] = s->type == SIG_BYTEBEAT;
+				break;
+			case BB_TIME:
+			case BB_128:
+				valid[sp++] = 1;
+				break;
+			case BB_NOT:
+				if (! valid[sp-1])
+					code[i] = BB_NOP;
+				break;
+			case BB_OR:
+			case BB_AND:
+			case BB_XOR:
+				sp--;
+				valid[sp-1] |= valid[sp];
+				break;
+		}
 	}
 
-	ds = *state;
-
-	size = sizeof (sig_head) + 8 * sizeof (char[8]);
-	out = malloc (size);
-	out->type = SIG_UI;
-	out->size = size;
+	for (a = 0; a < pg->num_leaves; a++)
+	{
+		s = sig_of (pg->leaves[a]);
+		if (s->type == SIG_BYTEBEAT)
+			leaf[a] = (void *) (s + 1);
+		else
+			leaf[a] = silence_bb;
+	}
 
-	s_out = (void *) (out + 1);
-	if (in[0]->type == SIG_UI)
-		s_in = (void *) (in[0] + 1);
+	if (! valid[0])
+	{
+		out = sig_error();
+	}
 	else
-		s_in = empty_array;
-
-	for (x=0; x<8; x++) for (y=0; y<8; y++)
 	{
-		if (s_in[x][y] != ds->in[x][y])
+		// A block of steps at a time: each instruction is a short loop
+		// over registers' worth of values instead of a dispatch per step.
+		// Only the steps of this period are needed.
+		for (a = 0; a < bb_steps; a += BB_BLOCK)
 		{
-			if (s_in[x][y] == 1)
-				ds->out[x][y] = ! ds->out[x][y];
+			n = bb_steps - a < BB_BLOCK ? bb_steps - a : BB_BLOCK;
+			sp = 0;
+			for (i = 0; i < pg->len; i++)
+			{
+				switch (code[i])
+				{
+					case BB_LOAD:
+						src = leaf[(int) pg->arg[i]] + a;
+						for (b = 0; b < n; b++)
+							st[sp][b] = src[b];
+						sp++;
+						break;
+					case BB_TIME:
+						t = *pg->clocks[(int) pg->arg[i]] + a;
+						for (b = 0; b < n; b++)
+							st[sp][b] = t + b;
+						sp++;
+						break;
+					case BB_128:
+						for (b = 0; b < n; b++)
+							st[sp][b] = 128;
+						sp++;
+						break;
+					case BB_SHR:
+						x = st[sp-1];
+						for (b = 0; b < n; b++)
+							x[b] = x[b] >> 1;
+						break;
+					case BB_NOT:
+						x = st[sp-1];
+						for (b = 0; b < n; b++)
+							x[b] = ~ x[b];
+						break;
+					case BB_OR:
+						x = st[sp-1];
+						y = st[sp-2];
+						for (b = 0; b < n; b++)
+							y[b] = y[b] | x[b];
+						sp--;
+						break;
+					case BB_AND:
+						x = st[sp-1];
+						y = st[sp-2];
+						for (b = 0; b < n; b++)
+							y[b] = y[b] & x[b];
+						sp--;
+						break;
+					case BB_XOR:
+						x = st[sp-1];
+						y = st[sp-2];
+						for (b = 0; b < n; b++)
+							y[b] = y[b] ^ x[b];
+						sp--;
+						break;
+				}
+			}
 
-			ds->in[x][y] = s_in[x][y];
+			for (b = 0; b < n; b++)
+				values[a+b] = st[0][b];
 		}
 
-		s_out[x][y] = ds->out[x][y];
+		// Same stream as op_bb_audio, which this instance is
+		out = bb_render (&inst_list[p].state, values);
 	}
 
+	for (a = 0; a < pg->num_clocks; a++)
+		*pg->clocks[a] += bb_steps;
+
 	return out;
 }
 
-sig_head *op_logic_or (sig_head *in[], void **state)
+//==============================================================================
+// Elementwise fusion
+//
+// attenuate, inverse, saturate, add and mult work sample by sample, so a
+// chain of them (playback, attenuate, inverse, saturate, add...) needn't
+// go through a buffer per step. When the schedule is rebuilt, each such
+// chain is compiled into one vec_run() program, which the instance at its
+// end runs over the period: only that end gives an output.
+//
+// The same rules as for bytebeat expressions decide what is folded. The
+// program only runs if every step would take its audio path this period;
+// otherwise (control ramps, bytebeats going through add...) the folded
+// components are called one after the other, as they would have been.
+
+int ew_opcode (compop op, float *k)
 {
-	sig_head *out;
-	sig_t_ui s_in1, s_in2, s_out;
-	int size;
-	int x, y;
-
-	if (in[0]->type != SIG_UI && in[1]->type != SIG_UI)
+	if (op == op_attenuate)
 	{
-		out = sig_error();
+		*k = 0.7f;
+		return VEC_SCALE;
 	}
-	else
+	if (op == op_inverse)
 	{
-		size = sizeof (sig_head) + 8 * sizeof (char[8]);
-		out = malloc (size);
-		out->type = SIG_UI;
-		out->size = size;
+		*k = -1.0f;
+		return VEC_SCALE;
+	}
+	if (op == op_saturate)
+		return VEC_SIN;
+	if (op == op_add)
+		return VEC_ADD;
+	if (op == op_mult)
+		return VEC_MULT;
+
+	return -1;
+}
 
-		s_out = (void *) (out + 1);
-		if (in[0]->type == SIG_UI)
-			s_in1 = (void *) (in[0] + 1);
-		else
-			s_in1 = empty_array;
-		if (in[1]->type == SIG_UI)
-			s_in2 = (void *) (in[1] + 1);
-		else
-			s_in2 = empty_array;
+void ew_gather (int c, char *member)
+{
+	instance *inst;
+	float k;
+	int a;
 
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
-		{
-			s_out[x][y] = s_in1[x][y] | s_in2[x][y];
-		}
-	}
+	if (c < 0 || member[c] || ew_absorbed[c] || ew_fused[c])
+		return;
 
-	return out;
+	inst = &inst_list[c];
+	if (ew_opcode (inst->c.op, &k) < 0 || fuse_exported (inst->p))
+		return;
+
+	member[c] = 1;
+	for (a = 0; a < inst->c.num_inputs; a++)
+		ew_gather (inst->src[a], member);
 }
 
-sig_head *op_note_wrap (sig_head *in[], void **state)
+// Postfix code for the chain ending at 'c', returns the index of its last
+// instruction or -1
+int ew_compile (ew_prog *pg, int c, char *member, char *path, int *sp, int *loads)
 {
-	sig_head *out;
-	sig_t_ui s_in, s_out;
-	int size;
-	int x, y, note;
-	int notes[128];
+	instance *inst;
+	int kids[MAX_COMP_ARGS];
+	int op, a, j;
+	float k;
 
-	if (in[0]->type != SIG_UI)
+	inst = c < 0 ? NULL : &inst_list[c];
+	k = 0;
+
+	if (c >= 0 && member[c])
 	{
-		out = sig_error();
+		if (path[c])
+			return -1;
+		path[c] = 1;
+
+		for (a = 0; a < inst->c.num_inputs; a++)
+		{
+			kids[a] = ew_compile (pg, inst->src[a], member, path, sp, loads);
+			if (kids[a] < 0)
+				return -1;
+		}
+
+		path[c] = 0;
+		op = ew_opcode (inst->c.op, &k);
+		*sp -= inst->c.num_inputs - 1;
 	}
 	else
 	{
-		size = sizeof (sig_head) + 8 * sizeof (char[8]);
-		out = malloc (size);
-		out->type = SIG_UI;
-		out->size = size;
+		if (*loads == EW_MAX_LOADS)
+			return -1;
 
-		s_out = (void *) (out + 1);
-		s_in = (void *) (in[0] + 1);
+		for (a = 0; a < pg->num_leaves; a++)
+			if (pg->leaves[a] == c)
+				break;
+		if (a == pg->num_leaves)
+			pg->leaves[pg->num_leaves++] = c;
 
-		bzero (notes, sizeof (int[128]));
-		bzero (s_out, 8 * sizeof (char[8]));
+		op = VEC_LOAD;
+		*sp += 1;
+	}
 
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
-		{
-			if (s_in[x][y] == 1)
-			{
-				note = (8 - x) * 3 + (8 - y) * 4 + 46;
-				notes[note] = 1;
-			}
-		}
+	if (pg->len == EW_MAX_CODE || *sp > VEC_STACK)
+		return -1;
 
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
-		{
-			note = (8 - x) * 3 + (8 - y) * 4 + 46;
-			if (notes[note] == 1)
-			{
-				s_out[x][y] = 1;
-			}
-		}
-	}
+	j = pg->len++;
+	pg->code[j].op = op;
+	pg->code[j].arg = op == VEC_LOAD ? (*loads)++ : 0;
+	pg->code[j].k = k;
+	pg->at[j] = c;
+	pg->parent[j] = -1;
 
-	return out;
+	if (op != VEC_LOAD)
+		for (a = 0; a < inst->c.num_inputs; a++)
+			pg->parent[kids[a]] = j;
+
+	return j;
 }
 
-sig_head *op_game_of_life (sig_head *in[], void **state)
+void ew_fuse (void)
 {
-	sig_head *out;
-	sig_t_ui s_in, s_out;
-	int size;
-	int x, y, num;
+	fuse_info fi;
+	char *member, *path;
+	instance *inst;
+	ew_prog *pg;
+	int p, a, i, sp, loads, folded;
+	float k;
 
-	if (in[0]->type != SIG_UI)
+	for (i = 0; i < ew_fused_len; i++)
+		free (ew_fused[i]);
+
+	ew_fused_len = num_insts;
+	ew_fused = realloc (ew_fused, (num_insts + 1) * sizeof (ew_prog *));
+	ew_absorbed = realloc (ew_absorbed, num_insts + 1);
+	for (i = 0; i < num_insts; i++)
 	{
-		out = sig_error();
+		ew_fused[i] = NULL;
+		ew_absorbed[i] = 0;
 	}
-	else
-	{
-		size = sizeof (sig_head) + 8 * sizeof (char[8]);
-		out = malloc (size);
-		out->type = SIG_UI;
-		out->size = size;
 
-		s_out = (void *) (out + 1);
-		s_in = (void *) (in[0] + 1);
+	if (! ew_fusion)
+		return;
 
-		bzero (s_out, 8 * sizeof (char[8]));
+	fuse_scan (&fi);
+	member = malloc (num_insts + 1);
+	path = calloc (num_insts + 1, 1);
 
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
+	// From the end of the schedule, so that chains are folded from their
+	// last instance
+	for (i = schedule_len - 1; i >= 0; i--)
+	{
+		p = schedule[i];
+		inst = &inst_list[p];
+		if (ew_absorbed[p] || ew_opcode (inst->c.op, &k) < 0)
+			continue;
+
+		bzero (member, num_insts);
+		for (a = 0; a < inst->c.num_inputs; a++)
+			ew_gather (inst->src[a], member);
+		member[p] = 0;
+		fuse_prune (&fi, p, member);
+
+		folded = 0;
+		for (a = 0; a < inst->c.num_inputs; a++)
+			if (inst->src[a] >= 0)
+				folded |= member[inst->src[a]];
+		if (! folded)
+			continue;
+
+		pg = calloc (1, sizeof (ew_prog));
+		sp = loads = 0;
+		member[p] = 1;
+		if (ew_compile (pg, p, member, path, &sp, &loads) < 0)
 		{
-			num = 0;
-			num += s_in[(x+0)&7][(y+1)&7];
-			num += s_in[(x+1)&7][(y+1)&7];
-			num += s_in[(x+1)&7][(y+0)&7];
-			num += s_in[(x+1)&7][(y-1)&7];
-			num += s_in[(x+0)&7][(y-1)&7];
-			num += s_in[(x-1)&7][(y-1)&7];
-			num += s_in[(x-1)&7][(y+0)&7];
-			num += s_in[(x-1)&7][(y+1)&7];
-
-			if (s_in[x][y] == 1)
-				if (num == 2 || num == 3)
-					s_out[x][y] = 1;
-				else
-					s_out[x][y] = 0;
-			else
-				if (num == 3)
-					s_out[x][y] = 1;
-				else
-					s_out[x][y] = 0;
+			free (pg);
+			bzero (path, num_insts);
+			continue;
 		}
+		member[p] = 0;
+
+		ew_fused[p] = pg;
+		for (a = 0; a < num_insts; a++)
+			if (member[a])
+				ew_absorbed[a] = 1;
 	}
 
-	return out;
-}
+	free (member);
+	free (path);
+	fuse_free (&fi);
 
-//==============================================================================
-// Synthesis components
+	fuse_drop (ew_absorbed);
+}
 
-typedef struct
+int ew_unchanged (int p)
 {
-	double time;
-} synth_state;
+	instance *inst;
+	ew_prog *pg;
+	unsigned long gen;
+	int a, same;
 
-sig_head *op_sine_synth (sig_head *in[], void **state)
-{
-	sig_head *out;
-	synth_state *ds;
-	sig_t_ui s_in;
-	sig_t_audio s_out, s_offset;
-	int size;
-	int a, x, y;
+	inst = &inst_list[p];
+	pg = ew_fused[p];
 
-	int note;
-	double freq, t;
+	same = ! inst->fresh;
+	inst->fresh = 0;
 
-	if (! *state)
+	for (a = 0; a < pg->num_leaves; a++)
 	{
-		*state = malloc (sizeof (synth_state));
-		ds = *state;
-		ds->time = 0;
+		gen = gen_of (pg->leaves[a]);
+		if (gen != pg->seen[a])
+			same = 0;
+		pg->seen[a] = gen;
 	}
 
-	s_offset = silence;
-	if (in[0]->type == SIG_AUDIO)
+	return same;
+}
+
+// The folded components one by one
+sig_head *ew_call (ew_prog *pg)
+{
+	sig_head *st[VEC_STACK], *out;
+	instance *inst;
+	int a, j, n, sp;
+
+	sp = 0;
+	for (j = 0; j < pg->len; j++)
 	{
-		s_offset = (void *) (in[0] + 1);
+		if (pg->code[j].op == VEC_LOAD)
+		{
+			st[sp++] = sig_ref (sig_of (pg->at[j]));
+			continue;
+		}
+
+		inst = &inst_list[pg->at[j]];
+		n = inst->c.num_inputs;
+		out = (*(inst->c.op)) (st + sp - n, &inst->state);
+
+		for (a = 0; a < n; a++)
+			sig_unref (st[--sp]);
+		st[sp++] = out;
 	}
 
-	if (in[1]->type != SIG_UI)
+	return st[0];
+}
+
+sig_head *ew_run (int p)
+{
+	sig_head *out, *s;
+	ew_prog *pg;
+	sig_t_audio s_out;
+	sig_audio ramp[EW_MAX_LOADS][MAX_PSIZE];
+	float *src[EW_MAX_LOADS];
+	int type[EW_MAX_CODE], channels[EW_MAX_CODE], plane[EW_MAX_CODE];
+	int st[VEC_STACK];
+	int c, j, k1, k2, sp;
+
+	pg = ew_fused[p];
+
+	// What each step gives, audio all the way or not at all
+	sp = 0;
+	for (j = 0; j < pg->len; j++)
 	{
-		out = sig_error();
-		// BUG: the time should still pass.
+		switch (pg->code[j].op)
+		{
+			case VEC_LOAD:
+				s = sig_of (pg->at[j]);
+				type[j] = s->type;
+				channels[j] = audio_channels (s);
+				break;
+			case VEC_SCALE:
+			case VEC_SIN:
+				k1 = st[--sp];
+				if (type[k1] != SIG_AUDIO)
+					return ew_call (pg);
+				type[j] = SIG_AUDIO;
+				channels[j] = channels[k1];
+				break;
+			default:
+				k2 = st[--sp];
+				k1 = st[--sp];
+				if (type[k1] != SIG_AUDIO && type[k2] != SIG_AUDIO)
+					return ew_call (pg);
+				type[j] = SIG_AUDIO;
+				channels[j] = channels[k1] > channels[k2] ? channels[k1] : channels[k2];
+				break;
+		}
+		st[sp++] = j;
 	}
-	else
-	{
-		ds = *state;
-
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
-		out->type = SIG_AUDIO;
-		out->size = size;
 
-		s_out = (void *) (out + 1);
-		s_in = (void *) (in[1] + 1);
+	j = pg->len - 1;
+	out = sig_new_audio (channels[j]);
+	s_out = (void *) (out + 1);
 
-		for (a = 0; a < PSIZE; a++)
-			s_out[a] = 0;
+	for (c = 0; c < out->channels; c++)
+	{
+		// Channels are reused round-robin at every step, as audio_plane()
+		// does for the components
+		plane[pg->len - 1] = c;
+		for (j = pg->len - 2; j >= 0; j--)
+			plane[j] = plane[(int) pg->parent[j]] % channels[j];
 
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
+		for (j = 0; j < pg->len; j++)
 		{
-			if (s_in[x][y] == 1)
+			if (pg->code[j].op == VEC_LOAD)
 			{
-				note = (8 - x) * 3 + (8 - y) * 4 + 46;
-				freq = 440 * exp (log (2) * (note - 69) / 12);
-				t = ds->time;
-
-				for (a = 0; a < PSIZE; a++)
-				{
-					s_out[a] += sin ((t * 2 * M_PI) * freq);
-					t += exp (s_offset[a]) / SAMPLE_RATE;
-				}
+				s = sig_of (pg->at[j]);
+				src[pg->code[j].arg] = audio_plane (s, plane[j], ramp[pg->code[j].arg]);
 			}
 		}
 
-		for (a = 0; a < PSIZE; a++)
-			ds->time += exp (s_offset[a]) / SAMPLE_RATE;
+		vec_run (s_out + c * psize, pg->code, pg->len, src, psize);
 	}
 
 	return out;
 }
 
-sig_head *op_square_synth (sig_head *in[], void **state)
-{
-	sig_head *out;
-	synth_state *ds;
-	sig_t_ui s_in;
-	sig_t_audio s_out, s_offset;
-	int size;
-	int a, x, y;
+//==============================================================================
+// UI components
 
-	int note;
-	double freq, t;
+sig_head *op_array_1 (sig_head *in[], void **state)
+{
+	sig_t_ui s;
+	int x, y;
 
-	if (! *state)
+	s = 0;
+	for (x=0; x<8; x++) for (y=0; y<8; y++)
 	{
-		*state = malloc (sizeof (synth_state));
-		ds = *state;
-		ds->time = 0;
+		if (input[x+10][y+1])
+			s |= UI_BIT (x, y);
 	}
 
-	s_offset = silence;
-	if (in[0]->type == SIG_AUDIO)
-	{
-		s_offset = (void *) (in[0] + 1);
-	}
+	return sig_new_ui (s);
+}
 
-	if (in[1]->type != SIG_UI)
+sig_head *op_array_2 (sig_head *in[], void **state)
+{
+	sig_t_ui s;
+	int x, y;
+
+	s = 0;
+	for (x=0; x<8; x++) for (y=0; y<8; y++)
 	{
-		out = sig_error();
+		if (input[x+1][y+1])
+			s |= UI_BIT (x, y);
 	}
-	else
-	{
-		ds = *state;
 
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
-		out->type = SIG_AUDIO;
-		out->size = size;
+	return sig_new_ui (s);
+}
 
-		s_out = (void *) (out + 1);
-		s_in = (void *) (in[1] + 1);
+// The two buttons of a controller pair, at (0,0) and (0,1)
+sig_head *ctrl_pair (int x)
+{
+	sig_t_ui s;
 
-		for (a = 0; a < PSIZE; a++)
-			s_out[a] = 0;
+	s = 0;
+	if (input[x][0])
+		s |= UI_BIT (0, 0);
+	if (input[x+1][0])
+		s |= UI_BIT (0, 1);
 
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
-		{
-			if (s_in[x][y] == 1)
-			{
-				note = (8 - x) * 3 + (8 - y) * 4 + 46;
-				freq = 440 * exp (log (2) * (note - 69) / 12);
-				t = ds->time;
+	return sig_new_ui (s);
+}
 
-				for (a = 0; a < PSIZE; a++)
-				{
-					s_out[a] += (sin ((t * 2 * M_PI) * freq) > 0)?1:-1;
-					t += exp (s_offset[a]) / SAMPLE_RATE;
-				}
-			}
-		}
+sig_head *op_ctrl1 (sig_head *in[], void **state)
+{
+	return ctrl_pair (10);
+}
+
+sig_head *op_ctrl2 (sig_head *in[], void **state)
+{
+	return ctrl_pair (12);
+}
+
+sig_head *op_ctrl3 (sig_head *in[], void **state)
+{
+	return ctrl_pair (14);
+}
+
+sig_head *op_ctrl4 (sig_head *in[], void **state)
+{
+	return ctrl_pair (16);
+}
+
+// Rows are bytes: turning the grid upside down is a byte swap
+sig_head *op_mirror (sig_head *in[], void **state)
+{
+	sig_head *out;
 
-		for (a = 0; a < PSIZE; a++)
-			ds->time += exp (s_offset[a]) / SAMPLE_RATE;
+	if (in[0]->type != SIG_UI)
+	{
+		out = sig_error();
+	}
+	else
+	{
+		out = sig_new_ui (__builtin_bswap64 (ui_of (in[0])));
 	}
 
 	return out;
 }
 
-sig_head *op_sawtooth_synth (sig_head *in[], void **state)
+typedef struct
 {
-	sig_head *out;
-	synth_state *ds;
-	sig_t_ui s_in;
-	sig_t_audio s_out, s_offset;
-	int size;
-	int a, x, y;
+	sig_t_ui in;
+	sig_t_ui out;
+} toggle_state;
 
-	int note;
-	double freq, t;
+// Every button just pressed flips its cell
+sig_head *op_toggle (sig_head *in[], void **state)
+{
+	toggle_state *ds;
+	sig_t_ui s_in;
 
 	if (! *state)
 	{
-		*state = malloc (sizeof (synth_state));
+		*state = malloc (sizeof (toggle_state));
 		ds = *state;
-		ds->time = 0;
+		ds->in = ds->out = 0;
 	}
 
-	s_offset = silence;
-	if (in[0]->type == SIG_AUDIO)
-	{
-		s_offset = (void *) (in[0] + 1);
-	}
+	ds = *state;
 
-	if (in[1]->type != SIG_UI)
+	s_in = ui_of (in[0]);
+	ds->out ^= s_in & ~ ds->in;
+	ds->in = s_in;
+
+	return sig_new_ui (ds->out);
+}
+
+sig_head *op_logic_or (sig_head *in[], void **state)
+{
+	sig_head *out;
+
+	if (in[0]->type != SIG_UI && in[1]->type != SIG_UI)
 	{
 		out = sig_error();
 	}
 	else
 	{
-		ds = *state;
-
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
-		out->type = SIG_AUDIO;
-		out->size = size;
-
-		s_out = (void *) (out + 1);
-		s_in = (void *) (in[1] + 1);
-
-		for (a = 0; a < PSIZE; a++)
-			s_out[a] = 0;
-
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
-		{
-			if (s_in[x][y] == 1)
-			{
-				note = (8 - x) * 3 + (8 - y) * 4 + 46;
-				freq = 440 * exp (log (2) * (note - 69) / 12);
-				t = ds->time;
-
-				for (a = 0; a < PSIZE; a++)
-				{
-					s_out[a] += ((t * freq) - floor (t * freq)) * 2 - 1;
-					t += exp (s_offset[a]) / SAMPLE_RATE;
-				}
-			}
-		}
-
-		for (a = 0; a < PSIZE; a++)
-			ds->time += exp (s_offset[a]) / SAMPLE_RATE;
+		out = sig_new_ui (ui_of (in[0]) | ui_of (in[1]));
 	}
 
 	return out;
 }
 
-typedef struct
-{
-	double value;
-} slider_state;
-
-#define SLIDE_RATE 0.1
+// Lights every button playing the same note as a pressed one. The note of
+// (x,y) goes with 3x+4y, and within the grid only (x+4,y-3) and (x-4,y+3)
+// share it: those are the only cells to copy each button to.
+#define UI_COLS_0_4 0x1f1f1f1f1f1f1f1fULL
+#define UI_COLS_3_7 0xf8f8f8f8f8f8f8f8ULL
 
-sig_head *op_slider (sig_head *in[], void **state)
+sig_head *op_note_wrap (sig_head *in[], void **state)
 {
 	sig_head *out;
-	slider_state *ds;
 	sig_t_ui s_in;
-	sig_t_audio s_out;
-	int size;
-	int a, x, y;
-
-	double value, rate;
 
-	if (! *state)
+	if (in[0]->type != SIG_UI)
 	{
-		*state = malloc (sizeof (slider_state));
-		ds = *state;
-		ds->value = 0;
+		out = sig_error();
+	}
+	else
+	{
+		s_in = ui_of (in[0]);
+		out = sig_new_ui (s_in
+			| ((s_in >> 3) & UI_COLS_0_4) << 32
+			| ((s_in << 3) & UI_COLS_3_7) >> 32);
 	}
 
-	ds = *state;
+	return out;
+}
 
-	size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-	out = malloc (size);
-	out->type = SIG_AUDIO;
-	out->size = size;
+// The grid moved one cell along a row or a column, wrapping around: cell
+// (x,y) of the result is cell (x+1,y), (x-1,y), (x,y+1) or (x,y-1)
+#define UI_COL_0 0x0101010101010101ULL
+#define UI_COL_7 0x8080808080808080ULL
 
-	s_out = (void *) (out + 1);
-	if (in[0]->type == SIG_UI)
-		s_in = (void *) (in[0] + 1);
-	else s_in = empty_array;
+sig_t_ui ui_next_row (sig_t_ui g)
+{
+	return g >> 8 | g << 56;
+}
 
-	value = ds->value;
-	rate = 0;
+sig_t_ui ui_prev_row (sig_t_ui g)
+{
+	return g << 8 | g >> 56;
+}
 
-	if (s_in[0][0] == 1)
-		rate += SLIDE_RATE;
-	if (s_in[0][1] == 1)
-		rate -= SLIDE_RATE;
+sig_t_ui ui_next_col (sig_t_ui g)
+{
+	return (g >> 1 & ~ UI_COL_7) | (g << 7 & UI_COL_7);
+}
+
+sig_t_ui ui_prev_col (sig_t_ui g)
+{
+	return (g << 1 & ~ UI_COL_0) | (g >> 7 & UI_COL_0);
+}
 
-	rate = rate / SAMPLE_RATE;
+// The eight neighbours of every cell are added at once, bit-sliced: bit
+// n of every cell's count is in word n. A count of 8 wraps to 0, which
+// is just as dead.
+sig_head *op_game_of_life (sig_head *in[], void **state)
+{
+	sig_head *out;
+	sig_t_ui s_in, up, down, nb[8];
+	sig_t_ui c0, c1, s0, s1, s2;
+	int a;
 
-	for (a = 0; a < PSIZE; a++)
+	if (in[0]->type != SIG_UI)
 	{
-		s_out[a] = value;
-		value += rate;
+		out = sig_error();
 	}
+	else
+	{
+		s_in = ui_of (in[0]);
+
+		up = ui_prev_row (s_in);
+		down = ui_next_row (s_in);
+		nb[0] = up;
+		nb[1] = down;
+		nb[2] = ui_prev_col (s_in);
+		nb[3] = ui_next_col (s_in);
+		nb[4] = ui_prev_col (up);
+		nb[5] = ui_next_col (up);
+		nb[6] = ui_prev_col (down);
+		nb[7] = ui_next_col (down);
+
+		s0 = s1 = s2 = 0;
+		for (a = 0; a < 8; a++)
+		{
+			c0 = s0 & nb[a];
+			s0 ^= nb[a];
+			c1 = s1 & c0;
+			s1 ^= c0;
+			s2 ^= c1;
+		}
 
-	ds->value = value;
+		// Born with 3, alive with 2 or 3
+		out = sig_new_ui (s1 & ~ s2 & (s0 | s_in));
+	}
 
 	return out;
 }
 
 //==============================================================================
-// Band-limited synthesis with libpolyseg
+// Synthesis components
 
-#define BUG_AMP 0.79
+// Naive synthesizers
+//
+// One oscillator per pressed button. The oscillators are kept as a
+// structure of arrays and rendered together by vec_osc(), with one phase
+// accumulator per voice. The pitch offset only depends on the sample, so
+// its exponential is computed once per sample rather than once per voice.
 
 typedef struct
-{	osc_stream *st;
-	double time;
-	osc_segdef seg;
-	int old_notes[128];
-	int num_notes;
-} osc_synth_state;
+{
+	double time;		// Warped time, to start new voices in phase
+	char pressed[64];
+	double phase[64];	// Per button, in cycles
+} synth_state;
 
-sig_head *op_bl_square_synth (sig_head *in[], void **state)
+sig_head *naive_synth (sig_head *in[], void **state, int wave)
 {
 	sig_head *out;
-	osc_synth_state *ds;
+	synth_state *ds;
 	sig_t_ui s_in;
 	sig_t_audio s_out, s_offset;
-	float polyseg_buffer[PSIZE];
 	int size;
-	int a, x, y;
+	int a, x, y, v;
 
-	osc_sample buf[PSIZE];
-	osc_clock deadline, next_time, next_period, next_slope, period, time, old_time, start;
-
-	double p0, p1, direction;
-
-	int note, note_change;
-	double freq, t;
-	double speed;
-	int notes[128];
+	int note;
+	double freq, dt, ph, f, r;
+	int cell[64];
+	float phase[64], freqs[64], inc[MAX_PSIZE];
+	sig_t_control c_offset;
 
 	if (! *state)
 	{
-		*state = malloc (sizeof (osc_synth_state));
+		*state = malloc (sizeof (synth_state));
 		ds = *state;
-		ds->st = osc_new_stream();
 		ds->time = 0;
-		ds->seg = (osc_segdef) {0, 0, 0, 0};
-		//osc_update_stream (ds->seg);
-		for (a=0; a<128; a++)
-			ds->old_notes[a] = 0;
-		ds->num_notes = 0;
+		bzero (ds->pressed, sizeof (ds->pressed));
 	}
 
 	s_offset = silence;
+	c_offset = NULL;
 	if (in[0]->type == SIG_AUDIO)
 	{
 		s_offset = (void *) (in[0] + 1);
 	}
+	else if (in[0]->type == SIG_CONTROL)
+	{
+		c_offset = (void *) (in[0] + 1);
+	}
 
 	if (in[1]->type != SIG_UI)
 	{
 		out = sig_error();
+		// BUG: the time should still pass.
 	}
 	else
 	{
 		ds = *state;
 
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
+		size = sizeof (sig_head) + psize * sizeof (sig_audio);
+		out = sig_alloc (size);
 		out->type = SIG_AUDIO;
+		out->frames = psize;
 		out->size = size;
 
 		s_out = (void *) (out + 1);
-		s_in = (void *) (in[1] + 1);
+		s_in = ui_of (in[1]);
 
-		//********************
-		bzero (notes, sizeof (int[128]));
-		for (x=0; x<8; x++) for (y=0; y<8; y++)
+		dt = 0;
+		if (c_offset)
 		{
-			if (s_in[x][y] == 1)
+			// The exponential of a ramp is a geometric progression
+			f = exp (c_offset->start) / srate;
+			r = exp ((c_offset->end - c_offset->start) / psize);
+			for (a = 0; a < psize; a++)
 			{
-				note = (8 - x) * 3 + (8 - y) * 4 + 46;
-				notes[note] = 1;
+				s_out[a] = 0;
+				inc[a] = f;
+				dt += inc[a];
+				f *= r;
 			}
 		}
-
-		speed = exp (s_offset[0]);
-		start = ds->time + ((double) PSIZE / SAMPLE_RATE);
-		deadline = ds->time + ((double) PSIZE / SAMPLE_RATE) * 2;
-
-		p0 = ds->seg.p0;
-		note_change = 0;
-		for (a=0; a<128; a++)
+		else for (a = 0; a < psize; a++)
 		{
-			if (notes[a] == 1 && ds->old_notes[a] == 0)
-			{
-				note = a;
-				freq = 440 * exp (log (2.00001) * (note - 69) / 12);
-
-				p0 += ((start * freq * speed) - floor (start * freq * speed)) < 0.5 ? BUG_AMP : -BUG_AMP;
+			s_out[a] = 0;
+			inc[a] = exp (s_offset[a]) / srate;
+			dt += inc[a];
+		}
 
-				ds->old_notes[a] = 1;
-				ds->num_notes++;
-				note_change = 1;
-			}
-			else if (notes[a] == 0 && ds->old_notes[a] == 1)
+		// Gather the active voices
+		v = 0;
+		for (x=0; x<8; x++) for (y=0; y<8; y++)
+		{
+			if (UI_CELL (s_in, x, y))
 			{
-				note = a;
-				freq = 440 * exp (log (2.00001) * (note - 69) / 12);
-
-				p0 -= ((start * freq * speed) - floor (start * freq * speed)) < 0.5 ? BUG_AMP : -BUG_AMP;
-
-				ds->old_notes[a] = 0;
-				ds->num_notes--;
-				note_change = 1;
-			}
-		}
+				note = (8 - x) * 3 + (8 - y) * 4 + 46;
+				freq = 440 * exp (log (2) * (note - 69) / 12);
 
-		if (note_change)
-		{
-			// printf ("p0: %f, p1: %f\n", p0, p1);
-			ds->seg.p0 = p0;
-			ds->seg.time = start;
+				if (! ds->pressed[x*8+y])
+					ds->phase[x*8+y] = ds->time * freq - floor (ds->time * freq);
 
-			if (ds->num_notes == 0 && abs (p0) > 0.0000001)
-			{
-				puts ("Drift detected, correcting...");
-				ds->seg.p0 = 0;
+				cell[v] = x*8+y;
+				phase[v] = ds->phase[x*8+y];
+				freqs[v] = freq;
+				v++;
 			}
 
-			osc_update_stream (ds->st, ds->seg);
+			ds->pressed[x*8+y] = UI_CELL (s_in, x, y);
 		}
 
-		// FIXME: Two events can be exactly simultaneous!
-		next_time = INFINITY;
-		for (a=0; a<128; a++)
+		vec_osc (s_out, phase, freqs, v, inc, psize, wave);
+
+		// The float accumulators drift a little: only trust them for one
+		// period, and carry the phases over in double precision.
+		while (v--)
 		{
-			if (notes[a] == 1)
-			{
-				note = a;
-				freq = speed * 440 * exp (log (2.00001) * (note - 69) / 12);
-				period = 0.5 * 1.0 / freq;
-				time = ceil (start / period) * period;
-				if (time <= start)
-					time = start + period;
-				if (time < next_time)
-				{
-					next_time = time;
-					if ((long) ((time / period) + 0.01) % 2 == 0)
-						direction = 1;
-					else
-						direction = -1;
-				}
-			}
+			ph = ds->phase[cell[v]] + freqs[v] * dt;
+			ds->phase[cell[v]] = ph - floor (ph);
 		}
 
-		while (next_time < deadline)
-		{
-			//printf ("%f %f %f\n", ds->seg.p0, ds->seg.p1, next_slope);
-			ds->seg.p0 += 2.0 * BUG_AMP * direction;
-			ds->seg.time = next_time;
-			start = next_time;
+		ds->time += dt;
+	}
 
-			osc_update_stream (ds->st, ds->seg);
-			//printf ("%f %f %f\n", ds->time, ds->seg.p0, ds->seg.p1);
+	return out;
+}
 
-			next_time = INFINITY;
-			for (a=0; a<128; a++)
-			{
-				if (notes[a] == 1)
-				{
-					note = a;
-					freq = speed * 440 * exp (log (2.00001) * (note - 69) / 12);
-					period = 0.5 * 1.0 / freq;
-					time = ceil (start / period) * period;
-					if (time < start + 0.0000000001)
-						time = start + period;
-					if (time < next_time)
-					{
-						next_time = time;
-						if ((long) ((time / period) + 0.01) % 2 == 0)
-							direction = 1;
-						else
-							direction = -1;
-					}
-				}
-			}
-		}
+sig_head *op_sine_synth (sig_head *in[], void **state)
+{
+	return naive_synth (in, state, OSC_SINE);
+}
 
-		osc_render_stream (ds->st, PSIZE, polyseg_buffer);
-		for (a = 0; a < PSIZE; a++)
-		{
-			s_out[a] = (sig_audio) polyseg_buffer[a];
-		}
+sig_head *op_square_synth (sig_head *in[], void **state)
+{
+	return naive_synth (in, state, OSC_SQUARE);
+}
+
+sig_head *op_sawtooth_synth (sig_head *in[], void **state)
+{
+	return naive_synth (in, state, OSC_SAWTOOTH);
+}
+
+typedef struct
+{
+	double value;
+} slider_state;
+
+#define SLIDE_RATE 0.1
 
-		//********************
+sig_head *op_slider (sig_head *in[], void **state)
+{
+	sig_head *out;
+	slider_state *ds;
+	sig_t_ui s_in;
+	int x, y;
+
+	double value, rate;
 
-		//for (a = 0; a < PSIZE; a++)
-		//	ds->time += (s_offset[a] + 1.0) / SAMPLE_RATE;
-		ds->time += (double) PSIZE / SAMPLE_RATE;
+	if (! *state)
+	{
+		*state = malloc (sizeof (slider_state));
+		ds = *state;
+		ds->value = 0;
 	}
 
+	ds = *state;
+
+	s_in = ui_of (in[0]);
+
+	value = ds->value;
+	rate = 0;
+
+	if (UI_CELL (s_in, 0, 0))
+		rate += SLIDE_RATE;
+	if (UI_CELL (s_in, 0, 1))
+		rate -= SLIDE_RATE;
+
+	rate = rate / srate;
+
+	ds->value = value + rate * psize;
+	out = sig_new_control (value, ds->value);
+
 	return out;
 }
 
-sig_head *op_bl_sawtooth_synth (sig_head *in[], void **state)
+//==============================================================================
+// Band-limited synthesis with libpolyseg
+
+#define BUG_AMP 0.79
+#define BL_TOP_NOTE 102	// Pad note at x = y = 0, about 2960 Hz
+
+// Highest pitch ratio that keeps the top pad note below Nyquist
+#define BL_MAX_SPEED (0.5 * srate / (440 * exp (log (2.00001) * (BL_TOP_NOTE - 69) / 12)))
+
+typedef struct
+{	osc_poly *poly;
+	double time;
+	double speed;
+	char notes[128];
+} osc_synth_state;
+
+// One libpolyseg voice per note, all summed into a single stream
+sig_head *bl_synth (sig_head *in[], void **state, int wave)
 {
 	sig_head *out;
 	osc_synth_state *ds;
 	sig_t_ui s_in;
 	sig_t_audio s_out, s_offset;
-	float polyseg_buffer[PSIZE];
 	int size;
 	int a, x, y;
 
-	osc_sample buf[PSIZE];
-	osc_clock deadline, next_time, next_period, next_slope, period, time, old_time, start;
+	osc_clock deadline, start;
 
-	double p0, p1;
-
-	int note, note_change;
-	double freq, t;
+	int note;
+	double freq;
 	double speed;
-	int notes[128];
+	char notes[128];
+	sig_audio offset;
 
 	if (! *state)
 	{
 		*state = malloc (sizeof (osc_synth_state));
 		ds = *state;
-		ds->st = osc_new_stream();
+		ds->poly = osc_new_poly();
 		ds->time = 0;
-		ds->seg = (osc_segdef) {0, 0, 0, 0};
-		//osc_update_stream (ds->seg);
-		for (a=0; a<128; a++)
-			ds->old_notes[a] = 0;
-		ds->num_notes = 0;
+		ds->speed = 1;
+		bzero (ds->notes, sizeof (ds->notes));
 	}
 
-	s_offset = silence;
+	offset = 0;
 	if (in[0]->type == SIG_AUDIO)
 	{
 		s_offset = (void *) (in[0] + 1);
+		offset = s_offset[0];
+	}
+	else if (in[0]->type == SIG_CONTROL)
+	{
+		offset = control_of (in[0])->start;
 	}
 
 	if (in[1]->type != SIG_UI)
@@ -2213,148 +4662,90 @@ sig_head *op_bl_sawtooth_synth (sig_head *in[], void **state)
 	{
 		ds = *state;
 
-		size = sizeof (sig_head) + PSIZE * sizeof (sig_audio);
-		out = malloc (size);
+		size = sizeof (sig_head) + psize * sizeof (sig_audio);
+		out = sig_alloc (size);
 		out->type = SIG_AUDIO;
+		out->frames = psize;
 		out->size = size;
 
 		s_out = (void *) (out + 1);
-		s_in = (void *) (in[1] + 1);
+		s_in = ui_of (in[1]);
 
-		//********************
-		bzero (notes, sizeof (int[128]));
+		bzero (notes, sizeof (notes));
 		for (x=0; x<8; x++) for (y=0; y<8; y++)
 		{
-			if (s_in[x][y] == 1)
+			if (UI_CELL (s_in, x, y))
 			{
 				note = (8 - x) * 3 + (8 - y) * 4 + 46;
 				notes[note] = 1;
 			}
 		}
 
-		speed = exp (s_offset[0]);
-		start = ds->time + ((double) PSIZE / SAMPLE_RATE);
-		deadline = ds->time + ((double) PSIZE / SAMPLE_RATE) * 2;
+		speed = fmin (exp (offset), BL_MAX_SPEED);
+		start = ds->time + ((double) psize / srate);
+		deadline = ds->time + ((double) psize / srate) * 2;
 
-		p0 = ds->seg.p0 + ds->seg.p1 * (start - ds->seg.time);
-		p1 = ds->seg.p1;
-		note_change = 0;
-		for (a=0; a<128; a++)
+		if (speed != ds->speed)
 		{
-			if (notes[a] == 1 && ds->old_notes[a] == 0)
-			{
-				note = a;
-				freq = 440 * exp (log (2.00001) * (note - 69) / 12);
-
-				p0 += BUG_AMP * (((start * freq * speed) - floor (start * freq * speed)) * 2 - 1);
-				p1 += BUG_AMP * 2.0 * freq * speed;
-
-				ds->old_notes[a] = 1;
-				ds->num_notes++;
-				note_change = 1;
-			}
-			else if (notes[a] == 0 && ds->old_notes[a] == 1)
-			{
-				note = a;
-				freq = 440 * exp (log (2.00001) * (note - 69) / 12);
-
-				p0 -= BUG_AMP * (((start * freq * speed) - floor (start * freq * speed)) * 2 - 1);
-				p1 -= BUG_AMP * 2.0 * freq * speed;
-
-				ds->old_notes[a] = 0;
-				ds->num_notes--;
-				note_change = 1;
-			}
+			osc_poly_retune (ds->poly, start, speed / ds->speed);
+			ds->speed = speed;
 		}
 
-		if (note_change)
+		for (a=0; a<128; a++)
 		{
-			// printf ("p0: %f, p1: %f\n", p0, p1);
-			ds->seg.p0 = p0;
-			ds->seg.p1 = p1;
-			ds->seg.time = start;
-
-			if (ds->num_notes == 0 && abs (p0) > 0.0000001)
-			{
-				puts ("Drift detected, correcting...");
-				ds->seg.p0 = 0;
-				ds->seg.p1 = 0;
-			}
+			if (notes[a] == ds->notes[a])
+				continue;
 
-			osc_update_stream (ds->st, ds->seg);
-		}
+			freq = speed * 440 * exp (log (2.00001) * (a - 69) / 12);
+			if (! notes[a])
+				osc_voice_stop (ds->poly, a, start);
+			else if (wave == OSC_SQUARE)
+				osc_voice_square (ds->poly, a, start, freq, BUG_AMP);
+			else
+				osc_voice_sawtooth (ds->poly, a, start, freq, BUG_AMP);
 
-		// FIXME: Two events can be exactly simultaneous!
-		next_time = INFINITY;
-		for (a=0; a<128; a++)
-		{
-			if (notes[a] == 1)
-			{
-				note = a;
-				freq = speed * 440 * exp (log (2.00001) * (note - 69) / 12);
-				period = 1.0 / freq;
-				time = ceil (start / period) * period;
-				if (time <= start)
-					time = start + period;
-				if (time < next_time)
-				{
-					next_time = time;
-				}
-			}
+			ds->notes[a] = notes[a];
 		}
 
-		while (next_time < deadline)
-		{
-			//printf ("%f %f %f\n", ds->seg.p0, ds->seg.p1, next_slope);
-			ds->seg.p0 = ds->seg.p0 + ds->seg.p1 * (next_time - ds->seg.time);
-			ds->seg.p0 += BUG_AMP * (-2.0);
-			ds->seg.time = next_time;
+		osc_poly_advance (ds->poly, deadline);
+		osc_render_stream (ds->poly->stream, psize, s_out);
 
-			osc_update_stream (ds->st, ds->seg);
-			//printf ("%f %f %f\n", ds->time, ds->seg.p0, ds->seg.p1);
+		//for (a = 0; a < psize; a++)
+		//	ds->time += (s_offset[a] + 1.0) / srate;
+		ds->time += (double) psize / srate;
+	}
 
-			next_time = INFINITY;
-			for (a=0; a<128; a++)
-			{
-				if (notes[a] == 1)
-				{
-					note = a;
-					freq = speed * 440 * exp (log (2.00001) * (note - 69) / 12);
-					period = 1.0 / freq;
-					time = ceil (ds->seg.time / period) * period;
-					if (time < ds->seg.time + 0.0000000001)
-						time = ds->seg.time + period;
-					if (time < next_time)
-					{
-						next_time = time;
-					}
-				}
-			}
-		}
+	return out;
+}
 
-		osc_render_stream (ds->st, PSIZE, polyseg_buffer);
-		for (a = 0; a < PSIZE; a++)
-		{
-			s_out[a] = (sig_audio) polyseg_buffer[a];
-		}
+// The voices, with the edges they haven't rendered yet
+void bl_synth_free (void *state)
+{
+	osc_synth_state *ds = state;
 
-		//********************
+	osc_free_poly (ds->poly);
+}
 
-		//for (a = 0; a < PSIZE; a++)
-		//	ds->time += (s_offset[a] + 1.0) / SAMPLE_RATE;
-		ds->time += (double) PSIZE / SAMPLE_RATE;
-	}
+sig_head *op_bl_square_synth (sig_head *in[], void **state)
+{
+	return bl_synth (in, state, OSC_SQUARE);
+}
 
-	return out;
+sig_head *op_bl_sawtooth_synth (sig_head *in[], void **state)
+{
+	return bl_synth (in, state, OSC_SAWTOOTH);
 }
 
 //==============================================================================
 // Utility functions
 
+// Only live instances are written, row by row. Saves from v0.1.4b, which
+// listed every spot of the old 8x64 grid, load all the same.
 void save_state (void)
 {
-	int x, y, a;
-	instance i;
+	int *order;
+	int n, a;
+	instance *i;
 	FILE *f;
 
 	puts ("save");
@@ -2362,81 +4753,217 @@ void save_state (void)
 	mkdir ("Data", 0777);
 	f = fopen ("Data/stacy.save", "w");
 	fprintf (f, "Stacy v%s save file\n", VERSION);
-	for (y=0; y<64; y++) for (x=0; x<8; x++)
+	order = inst_sorted (row_cmp);
+	for (n = 0; n < num_insts; n++)
 	{
-		i = inst_table[x][y];
-		if (! i.empty)
-		{
-			fprintf (f, "(%d %d) 1 ", y, x);
-			fprintf (f, "(%d %d) [ ", i.c.p.y, i.c.p.x);
-			for (a=0; a<MAX_COMP_ARGS; a++)
-			{
-				if (a < i.c.num_inputs)
-					fprintf (f, "(%d %d) ", i.inputs[a].y, i.inputs[a].x);
-				else
-					fprintf (f, "(0 0) ");
-			}
-			fprintf (f, "] \n");
-		}
-		else
+		i = &inst_list[order[n]];
+		fprintf (f, "(%d %d) 1 ", i->p.y, i->p.x);
+		fprintf (f, "(%d %d) [ ", i->c.p.y, i->c.p.x);
+		for (a=0; a<MAX_COMP_ARGS; a++)
 		{
-			fprintf (f, "(%d %d) 0 \n", y, x);
+			if (a < i->c.num_inputs)
+				fprintf (f, "(%d %d) ", i->inputs[a].y, i->inputs[a].x);
+			else
+				fprintf (f, "(0 0) ");
 		}
+		fprintf (f, "] \n");
+	}
+	free (order);
+	fclose (f);
+}
+
+void dump_profile (void)
+{
+	prof_stat *p;
+	instance *i;
+	FILE *f;
+	int *order;
+	int n, a;
+
+	mkdir ("Data", 0777);
+	f = fopen ("Data/profile.txt", "a");
+	if (! f)
+		return;
+
+	fprintf (f, "period %lu\n", session_timer);
+
+	// Period load: tenths of the budget, then up to 2x, then more
+	fprintf (f, "load");
+	for (a = 0; a < PROF_BUCKETS; a++)
+		fprintf (f, " %lu", prof_hist[a]);
+	fprintf (f, "\n");
+
+	// Instance costs over the last second, in ns
+	order = inst_sorted (row_cmp);
+	for (n = 0; n < num_insts; n++)
+	{
+		i = &inst_list[order[n]];
+		p = &i->prof;
+		fprintf (f, "(%d %d) (%d %d) %.0f %.0f %.0f\n", i->p.y, i->p.x,
+			i->c.p.y, i->c.p.x,
+			p->last_min / prof_ticks_per_ns,
+			p->last_avg / prof_ticks_per_ns,
+			p->last_max / prof_ticks_per_ns);
 	}
+	free (order);
+	fprintf (f, "\n");
+
 	fclose (f);
 }
 
-void load_state (void)
+// Returns 0 if there is no save file or it isn't one we can read
+int load_state (void)
 {
 	FILE *f;
 	int x, y, a;
 	int px, py, pv;
-	instance *i;
-	char buf[256];
+	instance i;
+	char buf[256], cur[256];
 
 	puts ("load");
 
 	f = fopen ("Data/stacy.save", "r");
-	assert (f);
-	fgets (buf, 256, f);
-	if (strcmp ("Stacy v0.1.4b save file\n", buf) != 0)
+	if (! f)
 	{
-		puts ("Error: wrong save version");
-		return;
+		puts ("Error: could not open Data/stacy.save");
+		return 0;
 	}
 
-	bzero (inst_table, sizeof (inst_table));
-
-	for (y=0; y<64; y++) for (x=0; x<8; x++)
+	if (! fgets (buf, 256, f))
+		buf[0] = 0;
+	snprintf (cur, 256, "Stacy v%s save file\n", VERSION);
+	if (strcmp ("Stacy v0.1.4b save file\n", buf) != 0 && strcmp (cur, buf) != 0)
 	{
-		i = &(inst_table[x][y]);
-		i->empty = 1;
-		i->state = NULL;
+		puts ("Error: wrong save version");
+		fclose (f);
+		return 0;
 	}
 
-	for (y=0; y<64; y++) for (x=0; x<8; x++)
+	inst_clear();
+
+	bzero (&i, sizeof (i));
+	while (fscanf (f, "(%d %d) %d ", &y, &x, &pv) == 3)
 	{
-		fscanf (f, "(%d %d) %d ", &py, &px, &pv);
-		assert (px == x && py == y);
+		assert (x >= 0 && x < 8 && y >= 0);
 
 		if (pv)
 		{
-			i = &(inst_table[x][y]);
-			i->empty = 0;
-
 			fscanf (f, "(%d %d) [ ", &py, &px);
-			i->c = comp_table[px][py];
+			assert (px >= 0 && px < 8 && py >= 0 && py < 8);
+			i.c = comp_table[px][py];
 
 			for (a=0; a<MAX_COMP_ARGS; a++)
 			{
 				fscanf (f, "(%d %d) ", &py, &px);
-				i->inputs[a].x = px;
-				i->inputs[a].y = py;
+				i.inputs[a].x = px;
+				i.inputs[a].y = py;
 			}
 			fscanf (f, "] \n");
+
+			inst_put ((coord) {x, y}, &i);
 		}
 	}
 	fclose (f);
+
+	return 1;
+}
+
+//==============================================================================
+// Offline rendering
+//
+// Plays the saved patch as fast as the graph can be evaluated, without MIDI
+// or audio devices, and writes the stream that would have gone to ALSA.
+// Names ending in ".raw" get the bare samples, anything else a WAV header.
+
+char *render_file = NULL;
+double render_seconds = 10;
+
+// The RIFF and data chunk sizes are 32-bit
+#define WAV_MAX_DATA (0xffffffffUL - 36)
+
+void put_le (FILE *f, unsigned long v, int bytes)
+{
+	while (bytes--)
+	{
+		fputc (v & 0xff, f);
+		v >>= 8;
+	}
+}
+
+void wav_header (FILE *f, unsigned long frames)
+{
+	unsigned long data;
+
+	data = frames * out_channels * sizeof (signed short);
+	assert (data <= WAV_MAX_DATA);
+
+	fputs ("RIFF", f);
+	put_le (f, 36 + data, 4);
+	fputs ("WAVEfmt ", f);
+	put_le (f, 16, 4);
+	put_le (f, 1, 2);			// PCM
+	put_le (f, out_channels, 2);
+	put_le (f, srate, 4);
+	put_le (f, srate * out_channels * sizeof (signed short), 4);
+	put_le (f, out_channels * sizeof (signed short), 2);
+	put_le (f, 16, 2);
+	fputs ("data", f);
+	put_le (f, data, 4);
+}
+
+void render_offline (void)
+{
+	signed short samples[MAX_CHANNELS*MAX_PSIZE];
+	struct timespec start, end;
+	unsigned long periods, a;
+	double elapsed, total;
+	FILE *f;
+	int len, wav;
+
+	// Nothing is written unless there is something to render
+	if (! load_state())
+		exit (1);
+
+	total = ceil (render_seconds * srate / psize);
+	len = strlen (render_file);
+	wav = len < 4 || strcmp (render_file + len - 4, ".raw") != 0;
+	if (total > ULONG_MAX)
+	{
+		printf ("Error: %g s is too long to render\n", render_seconds);
+		exit (1);
+	}
+	if (wav && total * psize * out_channels * sizeof (signed short) > WAV_MAX_DATA)
+	{
+		printf ("Error: %g s is too long for a WAV file, use .raw\n", render_seconds);
+		exit (1);
+	}
+	periods = total;
+
+	f = fopen (render_file, "wb");
+	if (! f)
+	{
+		printf ("Error: could not open %s\n", render_file);
+		exit (1);
+	}
+
+	if (wav)
+		wav_header (f, periods * psize);
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (a = 0; a < periods; a++)
+	{
+		compute_signals();
+		output_period (samples);
+		fwrite (samples, out_channels * sizeof (signed short), psize, f);
+	}
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	fclose (f);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf ("Rendered %.1f s in %.2f s (%.1fx real time)\n",
+		(double) periods * psize / srate, elapsed,
+		(double) periods * psize / srate / elapsed);
 }
 
 //==============================================================================
@@ -2450,27 +4977,19 @@ void load_state (void)
 #define from_inst(c) ((coord) {(c).x + 10, ((c).y - inst_page * 8) + 1})
 #define to_inst(c)   ((coord) {(c).x - 10, ((c).y - 1) + inst_page * 8})
 
-int main (int argc, char *argv[])
+// Component table, by position on the editor's right pad
+void comp_init (void)
 {
 	int x, y;
 
-	printf ("Stacy %s started...\n", VERSION);
-
-	playback_init();
-	user_init();
-	osc_init (SAMPLE_RATE);
-
-	for (x=0; x<19; x++) for (y=0; y<9; y++)
-	{
-		input[x][y] = 0;
-		output[x][y] = 0;
-	}
-
 	for (x=0; x<8; x++) for (y=0; y<8; y++)
 	{
 		comp_table[x][y].empty = 1;
 		comp_table[x][y].p.x = x;
 		comp_table[x][y].p.y = y;
+		comp_table[x][y].pure = 0;
+		comp_table[x][y].reads_ui = 0;
+		comp_table[x][y].free_state = NULL;
 	}
 
 	// Line 1: Inputs
@@ -2483,89 +5002,134 @@ int main (int argc, char *argv[])
 	comp_table[1][0].empty = 0;
 	comp_table[1][0].num_inputs = 0;
 	comp_table[1][0].op = op_array_1;
+	comp_table[1][0].pure = 1;
+	comp_table[1][0].reads_ui = 1;
 
 	// Array #2
 	comp_table[2][0].empty = 0;
 	comp_table[2][0].num_inputs = 0;
 	comp_table[2][0].op = op_array_2;
+	comp_table[2][0].pure = 1;
+	comp_table[2][0].reads_ui = 1;
+
+	// Sampler
+	comp_table[3][0].empty = 0;
+	comp_table[3][0].num_inputs = 1;
+	comp_table[3][0].op = op_sampler;
 
 	// Control 1
 	comp_table[4][0].empty = 0;
 	comp_table[4][0].num_inputs = 0;
 	comp_table[4][0].op = op_ctrl1;
+	comp_table[4][0].pure = 1;
+	comp_table[4][0].reads_ui = 1;
 
 	// Control 2
 	comp_table[5][0].empty = 0;
 	comp_table[5][0].num_inputs = 0;
 	comp_table[5][0].op = op_ctrl2;
+	comp_table[5][0].pure = 1;
+	comp_table[5][0].reads_ui = 1;
 
 	// Control 3
 	comp_table[6][0].empty = 0;
 	comp_table[6][0].num_inputs = 0;
 	comp_table[6][0].op = op_ctrl3;
+	comp_table[6][0].pure = 1;
+	comp_table[6][0].reads_ui = 1;
 
 	// Control 4
 	comp_table[7][0].empty = 0;
 	comp_table[7][0].num_inputs = 0;
 	comp_table[7][0].op = op_ctrl4;
+	comp_table[7][0].pure = 1;
+	comp_table[7][0].reads_ui = 1;
 
 	// Line 2: Generic components
 	// Identity
 	comp_table[0][1].empty = 0;
 	comp_table[0][1].num_inputs = 1;
 	comp_table[0][1].op = op_identity;
+	comp_table[0][1].pure = 1;
 
 	// Delay
 	comp_table[1][1].empty = 0;
 	comp_table[1][1].num_inputs = 1;
 	comp_table[1][1].op = op_delay;
+	comp_table[1][1].free_state = delay_free;
 
 	// Synchronous delay
 	comp_table[2][1].empty = 0;
 	comp_table[2][1].num_inputs = 1;
 	comp_table[2][1].op = op_delay_sync;
+	comp_table[2][1].free_state = delay_sync_free;
 
-	// Line 3: Cartesian product
+	// Line 3: Cartesian product and channels
 	// Pair deconstruction
 	comp_table[0][2].empty = 0;
 	comp_table[0][2].num_inputs = 1;
 	comp_table[0][2].op = op_elem1;
+	comp_table[0][2].pure = 1;
 
 	// Pair deconstruction
 	comp_table[1][2].empty = 0;
 	comp_table[1][2].num_inputs = 1;
 	comp_table[1][2].op = op_elem2;
+	comp_table[1][2].pure = 1;
 
 	// Pair construction
 	comp_table[3][2].empty = 0;
 	comp_table[3][2].num_inputs = 2;
 	comp_table[3][2].op = op_pair;
+	comp_table[3][2].pure = 1;
+
+	// Panning
+	comp_table[5][2].empty = 0;
+	comp_table[5][2].num_inputs = 2;
+	comp_table[5][2].op = op_pan;
+	comp_table[5][2].pure = 1;
 
 	// Line 4: Audio components
 	// Attenuation
 	comp_table[0][3].empty = 0;
 	comp_table[0][3].num_inputs = 1;
 	comp_table[0][3].op = op_attenuate;
+	comp_table[0][3].pure = 1;
 
 	// Inversion
 	comp_table[1][3].empty = 0;
 	comp_table[1][3].num_inputs = 1;
 	comp_table[1][3].op = op_inverse;
+	comp_table[1][3].pure = 1;
+
+	// Delay line
+	comp_table[2][3].empty = 0;
+	comp_table[2][3].num_inputs = 2;
+	comp_table[2][3].op = op_delay_line;
+	comp_table[2][3].free_state = line_free;
 
 	// Addition
 	comp_table[3][3].empty = 0;
 	comp_table[3][3].num_inputs = 2;
 	comp_table[3][3].op = op_add;
+	comp_table[3][3].pure = 1;
 
 	// Multiplication
 	comp_table[4][3].empty = 0;
 	comp_table[4][3].num_inputs = 2;
 	comp_table[4][3].op = op_mult;
+	comp_table[4][3].pure = 1;
+
+	// Variable-speed playback
+	comp_table[5][3].empty = 0;
+	comp_table[5][3].num_inputs = 1;
+	comp_table[5][3].op = op_varispeed;
 
 	// Saturation
 	comp_table[6][3].empty = 0;
 	comp_table[6][3].num_inputs = 1;
 	comp_table[6][3].op = op_saturate;
+	comp_table[6][3].pure = 1;
 
 	// Equalizer
 	comp_table[7][3].empty = 0;
@@ -2577,26 +5141,31 @@ int main (int argc, char *argv[])
 	comp_table[0][4].empty = 0;
 	comp_table[0][4].num_inputs = 1;
 	comp_table[0][4].op = op_mirror;
+	comp_table[0][4].pure = 1;
 
 	// toggle
 	comp_table[1][4].empty = 0;
 	comp_table[1][4].num_inputs = 1;
 	comp_table[1][4].op = op_toggle;
+	comp_table[1][4].pure = 1;
 
 	// logic OR
 	comp_table[3][4].empty = 0;
 	comp_table[3][4].num_inputs = 2;
 	comp_table[3][4].op = op_logic_or;
+	comp_table[3][4].pure = 1;
 
 	// Note wrap
 	comp_table[5][4].empty = 0;
 	comp_table[5][4].num_inputs = 1;
 	comp_table[5][4].op = op_note_wrap;
+	comp_table[5][4].pure = 1;
 
 	// Game of Life
 	comp_table[7][4].empty = 0;
 	comp_table[7][4].num_inputs = 1;
 	comp_table[7][4].op = op_game_of_life;
+	comp_table[7][4].pure = 1;
 
 	// Line 6: Synthesizers
 	comp_table[0][5].empty = 0;
@@ -2614,10 +5183,12 @@ int main (int argc, char *argv[])
 	comp_table[4][5].empty = 0;
 	comp_table[4][5].num_inputs = 2;
 	comp_table[4][5].op = op_bl_square_synth;
+	comp_table[4][5].free_state = bl_synth_free;
 
 	comp_table[5][5].empty = 0;
 	comp_table[5][5].num_inputs = 2;
 	comp_table[5][5].op = op_bl_sawtooth_synth;
+	comp_table[5][5].free_state = bl_synth_free;
 
 	// Line 7: Controlers
 	comp_table[0][6].empty = 0;
@@ -2627,6 +5198,7 @@ int main (int argc, char *argv[])
 	comp_table[1][6].empty = 0;
 	comp_table[1][6].num_inputs = 1;
 	comp_table[1][6].op = op_bb_slider;
+	comp_table[1][6].pure = 1;
 
 	// Line 8: Bytebeat
 	comp_table[0][7].empty = 0;
@@ -2636,47 +5208,132 @@ int main (int argc, char *argv[])
 	comp_table[1][7].empty = 0;
 	comp_table[1][7].num_inputs = 1;
 	comp_table[1][7].op = op_bb_rshift;
+	comp_table[1][7].pure = 1;
 
 	comp_table[2][7].empty = 0;
 	comp_table[2][7].num_inputs = 1;
 	comp_table[2][7].op = op_bb_not;
+	comp_table[2][7].pure = 1;
 
 	comp_table[3][7].empty = 0;
 	comp_table[3][7].num_inputs = 2;
 	comp_table[3][7].op = op_bb_or;
+	comp_table[3][7].pure = 1;
 
 	comp_table[4][7].empty = 0;
 	comp_table[4][7].num_inputs = 2;
 	comp_table[4][7].op = op_bb_and;
+	comp_table[4][7].pure = 1;
 
 	comp_table[5][7].empty = 0;
 	comp_table[5][7].num_inputs = 2;
 	comp_table[5][7].op = op_bb_xor;
+	comp_table[5][7].pure = 1;
 
 	comp_table[6][7].empty = 0;
 	comp_table[6][7].num_inputs = 0;
 	comp_table[6][7].op = op_bb_onetwentyeight;
+	comp_table[6][7].pure = 1;
 
 	comp_table[7][7].empty = 0;
 	comp_table[7][7].num_inputs = 1;
 	comp_table[7][7].op = op_bb_audio;
+	comp_table[7][7].free_state = bb_audio_free;
+}
+
+#ifndef STACY_NO_MAIN
+void usage (char *name)
+{
+	printf ("Usage: %s [-j workers] [-a periods] [-p frames] [-r rate] [-b bytebeat rate] [-c channels] [-o file [-t seconds]]\n", name);
+	exit (1);
+}
 
-	for (x=0; x<8; x++) for (y=0; y<64; y++)
+int main (int argc, char *argv[])
+{
+	int x, y;
+	int opt, workers;
+
+	workers = sysconf (_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt (argc, argv, "j:a:o:t:p:r:b:c:")) != -1)
 	{
-		inst_table[x][y].empty = 1;
+		switch (opt)
+		{
+			case 'j':
+				workers = atoi (optarg);
+				break;
+			case 'a':
+				run_ahead = atoi (optarg);
+				if (run_ahead < 1)
+					run_ahead = 1;
+				if (run_ahead > RING_SIZE)
+					run_ahead = RING_SIZE;
+				break;
+			case 'o':
+				render_file = optarg;
+				break;
+			case 't':
+				render_seconds = atof (optarg);
+				if (! (render_seconds > 0) || isinf (render_seconds))
+					usage (argv[0]);
+				break;
+			case 'p':
+				set_period_size (atoi (optarg));
+				break;
+			case 'r':
+				srate = atoi (optarg);
+				if (srate < MIN_SRATE)
+					srate = MIN_SRATE;
+				if (srate > MAX_SRATE)
+					srate = MAX_SRATE;
+				break;
+			case 'b':
+				bb_rate = atoi (optarg);
+				break;
+			case 'c':
+				out_channels = atoi (optarg);
+				if (out_channels < 1)
+					out_channels = 1;
+				if (out_channels > MAX_CHANNELS)
+					out_channels = MAX_CHANNELS;
+				break;
+			default:
+				usage (argv[0]);
+		}
 	}
 
-	display_editor();
+	set_bb_sizes();
 
-	sig_error_c.type = SIG_ERROR;
-	sig_error_c.size = sizeof (sig_head);
+	printf ("Stacy %s started...\n", VERSION);
+
+	// ALSA may settle on another rate, which raw samples are played at
+	if (! render_file)
+		user_init();
+	playback_init();
+	osc_init (srate);
+	vec_init();
+	printf ("Using %s kernels\n", vec_isa);
+	prof_init();
+	workers_init (workers);
+	if (! render_file)
+		audio_init();
 
-	for (x=0; x<8; x++) for (y=0; y<64; y++)
+	for (x=0; x<19; x++) for (y=0; y<9; y++)
 	{
-		sig_table[x][y] = sig_error();
+		input[x][y] = 0;
+		output[x][y] = 0;
 	}
 
+	comp_init();
+
 	inst_page = 0;
+	display_editor();
+
+	if (render_file)
+	{
+		render_offline();
+		return 0;
+	}
 
 	int a;
 	button_evt *evx;
@@ -2687,6 +5344,8 @@ int main (int argc, char *argv[])
 	instance inst;
 	int current_input;
 	sig_t_bytebeat px;
+	sig_head *s;
+	instance *ip;
 	int bbv;
 
 	for (;;)
@@ -2694,22 +5353,37 @@ int main (int argc, char *argv[])
 		session_timer++;
 		dump_timer++;
 
-		user_process_audio();	// Blocking
-
 		compute_signals();
 
+		user_process_audio();	// Blocking while we're ahead
+
+		if (session_timer % PROF_WINDOW == 0)
+			report_xruns();
+
+		if (prof_dumping && dump_timer >= DUMP_PERIODS)
+		{
+			dump_profile();
+			dump_timer = 0;
+		}
+
+		if (state == S_UTIL && prof_updated)
+			display_profile();
+		prof_updated = 0;
+
 		evx = get_input();
 
 		// Controlers
 		if (evx && in_zone (evx->p, z_rup))
 		{
 			input[evx->p.x][evx->p.y] = evx->v;
+			ui_gen++;
 		}
 
 		// Timeline
-		if (sig_table[0][0] != NULL && sig_table[0][0]->type == SIG_BYTEBEAT)
+		s = sig_at ((coord) {0, 0});
+		if (s->type == SIG_BYTEBEAT)
 		{
-			px = (void *) (sig_table[0][0] + 1);
+			px = (void *) (s + 1);
 			bbv = px[0];
 
 			bbv = bbv >> 12;
@@ -2748,6 +5422,7 @@ int main (int argc, char *argv[])
 				else
 				{
 					input[evx->p.x][evx->p.y] = evx->v;
+					ui_gen++;
 				}
 
 				free (evx);
@@ -2768,9 +5443,15 @@ int main (int argc, char *argv[])
 			if (in_zone (ec, z_lup) && ex == 8)
 			{
 					if (ev == 1)
+					{
 						state = S_UTIL;
+						display_profile();
+					}
 					else
+					{
 						state = S_DEFAULT;
+						display_editor();
+					}
 			}
 
 			// Save, Load and dumps
@@ -2788,14 +5469,32 @@ int main (int argc, char *argv[])
 					inst_page = 0;
 					display_editor();
 				}
+
+				if (ex == 4)
+				{
+					prof_dumping = ! prof_dumping;
+					output[4][0] = prof_dumping ? C_RED : C_BLACK;
+					if (prof_dumping)
+						dump_profile();
+					dump_timer = 0;
+				}
 			}
 
-			if (in_zone (ec, z_rside))
+			if (in_zone (ec, z_rside) || (in_zone (ec, z_lup) && (ex == 6 || ex == 7)))
 			{
 				if (ev == 1)
 				{
-					inst_page = ey - 1;
-					display_editor();
+					if (ex == 18)
+						inst_page = inst_page / 8 * 8 + ey - 1;
+					else if (ex == 7)
+						inst_page += 8;
+					else if (inst_page >= 8)
+						inst_page -= 8;
+
+					if (state == S_UTIL)
+						display_profile();
+					else
+						display_editor();
 				}
 			}
 
@@ -2811,7 +5510,6 @@ int main (int argc, char *argv[])
 							{
 								put_color (ec, C_ORANGE);
 								inst.c = comp;
-								inst.empty = 0;
 								inst.state = NULL;
 								current_input = 0;
 								state = S_INSTANTIATE;
@@ -2820,7 +5518,6 @@ int main (int argc, char *argv[])
 							{
 								put_color (ec, C_RED);
 								inst.c = comp;
-								inst.empty = 0;
 								inst.state = NULL;
 								state = S_INSTANTIATE2;
 							}
@@ -2830,9 +5527,10 @@ int main (int argc, char *argv[])
 					{
 						// Show component inputs
 						// FIXME: non re-entrant
-						if (! inst_table[ex-10][ey-1+inst_page*8].empty)
+						ip = inst_at (to_inst (ec));
+						if (ip)
 						{
-							inst = inst_table[ex-10][ey-1+inst_page*8];
+							inst = *ip;
 							if (ev == 1)
 							{
 								put_color (from_comp(inst.c.p), C_ORANGE);
@@ -2889,14 +5587,12 @@ int main (int argc, char *argv[])
 					{
 						if (ev == 1)
 						{
-							inst_table[ex-10][ey-1+inst_page*8] = inst;
-							// FIXME: need to free old resources
+							inst_put (to_inst (ec), &inst);
 							put_color (ec, C_RED);
 							if (comp.num_inputs > 0)
 							{
 								put_color (from_comp(inst.c.p), C_ORANGE);
 								inst.c = comp;
-								inst.empty = 0;
 								inst.state = NULL;
 								current_input = 0;
 								state = S_INSTANTIATE;
@@ -2905,7 +5601,6 @@ int main (int argc, char *argv[])
 							{
 								put_color (from_comp(inst.c.p), C_RED);
 								inst.c = comp;
-								inst.empty = 0;
 								inst.state = NULL;
 								state = S_INSTANTIATE2;
 							}
@@ -2921,15 +5616,10 @@ int main (int argc, char *argv[])
 				case S_DELETE:
 					if (in_zone (ec, z_right))
 					{
-						if (ev == 1 && ! inst_table[ex-10][ey-1+inst_page*8].empty)
+						if (ev == 1 && inst_at (to_inst (ec)))
 						{
 							put_color (ec, C_RED);
-							inst_table[ex-10][ey-1+inst_page*8].empty = 1;
-							if (inst_table[ex-10][ey-1+inst_page*8].state)
-							{
-								free (inst_table[ex-10][ey-1+inst_page*8].state);
-								inst_table[ex-10][ey-1+inst_page*8].state = NULL;
-							}
+							inst_remove (to_inst (ec));
 						}
 						if (ev == 0)
 						{
@@ -2952,6 +5642,7 @@ int main (int argc, char *argv[])
 		update_output();
 	}
 }
+#endif
 
 //==============================================================================
 // EOF
@@ -0,0 +1,267 @@
+/*
+**    This file is part of Stacy, the algebraic audio workstation.
+**    Copyright (C) 2013-2014 Mikael Bouillot
+**
+**    Stacy is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Stacy is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with Stacy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <math.h>
+#include "vecops.h"
+
+/********** Sine approximation **********/
+
+// Odd polynomial fitted on [-pi/2, pi/2], error below 4e-9.
+// Arguments are brought back to that range first (Cody-Waite, pi in two
+// parts so that q * SIN_PI_A is exact).
+
+#define SIN_INV_PI ((float) M_1_PI)
+#define SIN_PI_A 3.140625f
+#define SIN_PI_B ((float) (M_PI - 3.140625))
+
+#define SIN_C1 9.9999997652e-01f
+#define SIN_C3 -1.6666647598e-01f
+#define SIN_C5 8.3328992842e-03f
+#define SIN_C7 -1.9800868459e-04f
+#define SIN_C9 2.5904355010e-06f
+
+/********** Portable versions **********/
+
+static void add_c (float *dst, const float *a, const float *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = a[i] + b[i];
+}
+
+static void mult_c (float *dst, const float *a, const float *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = a[i] * b[i];
+}
+
+static void scale_c (float *dst, const float *a, float k, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = a[i] * k;
+}
+
+static float sin_1 (float x)
+{
+	float q, r, r2, p;
+	int qi;
+
+	q = x * SIN_INV_PI;
+	qi = (int) (q + 0.5f + (q < 0.0f ? -1.0f : 0.0f));
+	q = (float) qi;
+	r = (x - q * SIN_PI_A) - q * SIN_PI_B;
+
+	r2 = r * r;
+	p = r * (SIN_C1 + r2 * (SIN_C3 + r2 * (SIN_C5 + r2 * (SIN_C7 + r2 * SIN_C9))));
+
+	return p * (1.0f - 2.0f * (float) (qi & 1));
+}
+
+static void sin_c (float *dst, const float *a, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = sin_1 (a[i]);
+}
+
+static void osc_c (float *out, float *phase, const float *freq, int voices, const float *inc, int n, int wave)
+{
+	float p, w;
+	int v, i;
+
+	for (v = 0; v < voices; v++)
+	{
+		p = phase[v];
+
+		for (i = 0; i < n; i++)
+		{
+			switch (wave)
+			{
+				case OSC_SINE:
+					w = sin_1 (p * (float) (2 * M_PI));
+					break;
+				case OSC_SQUARE:
+					w = (p > 0.0f && p < 0.5f) ? 1.0f : -1.0f;
+					break;
+				default:
+					w = p * 2.0f - 1.0f;
+					break;
+			}
+
+			out[i] += w;
+
+			p = p + freq[v] * inc[i];
+			p = p - (float) (int) p;
+		}
+
+		phase[v] = p;
+	}
+}
+
+static float dot_c (const float *a, const float *b, int n)
+{
+	float sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < n; i++)
+		sum += a[i] * b[i];
+
+	return sum;
+}
+
+static float run_1 (const vec_insn *code, int len, float *const *src, int i)
+{
+	float st[VEC_STACK];
+	int j, sp;
+
+	st[0] = 0;
+	sp = 0;
+	for (j = 0; j < len; j++)
+	{
+		switch (code[j].op)
+		{
+			case VEC_LOAD:
+				st[sp++] = src[code[j].arg][i];
+				break;
+			case VEC_SCALE:
+				st[sp-1] = st[sp-1] * code[j].k;
+				break;
+			case VEC_SIN:
+				st[sp-1] = sin_1 (st[sp-1]);
+				break;
+			case VEC_ADD:
+				sp--;
+				st[sp-1] = st[sp-1] + st[sp];
+				break;
+			case VEC_MULT:
+				sp--;
+				st[sp-1] = st[sp-1] * st[sp];
+				break;
+		}
+	}
+
+	return st[0];
+}
+
+static void run_c (float *dst, const vec_insn *code, int len, float *const *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = run_1 (code, len, src, i);
+}
+
+static void to_s16_c (signed short *dst, const float *a, float gain, int n)
+{
+	float x;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		x = a[i] * gain;
+
+		if (x < -1) x = -1;
+		if (x > 1) x = 1;
+
+		dst[i] = (signed short) (x * 32767.0f);
+	}
+}
+
+/********** Vector versions **********/
+
+#if defined (__x86_64__) || defined (__i386__) || defined (__ARM_NEON) || defined (__ARM_NEON__)
+#define HAVE_V4
+
+// SSE2 on x86, NEON on ARM
+#define VEC_WIDTH 4
+#define VEC_NAME(f) f##_v4
+#define VEC_TARGET
+#include "vecops_kernels.h"
+#undef VEC_WIDTH
+#undef VEC_NAME
+#undef VEC_TARGET
+#endif
+
+#if defined (__x86_64__) || defined (__i386__)
+#define HAVE_V8
+
+// AVX2, only used if the CPU has it
+#define VEC_WIDTH 8
+#define VEC_NAME(f) f##_v8
+#define VEC_TARGET __attribute__ ((target ("avx2")))
+#include "vecops_kernels.h"
+#undef VEC_WIDTH
+#undef VEC_NAME
+#undef VEC_TARGET
+#endif
+
+/********** Dispatch **********/
+
+const char *vec_isa = "C";
+
+void (*vec_add) (float *dst, const float *a, const float *b, int n) = add_c;
+void (*vec_mult) (float *dst, const float *a, const float *b, int n) = mult_c;
+void (*vec_scale) (float *dst, const float *a, float k, int n) = scale_c;
+void (*vec_sin) (float *dst, const float *a, int n) = sin_c;
+void (*vec_to_s16) (signed short *dst, const float *a, float gain, int n) = to_s16_c;
+float (*vec_dot) (const float *a, const float *b, int n) = dot_c;
+void (*vec_run) (float *dst, const vec_insn *code, int len, float *const *src, int n) = run_c;
+void (*vec_osc) (float *out, float *phase, const float *freq, int voices, const float *inc, int n, int wave) = osc_c;
+
+void vec_init (void)
+{
+#ifdef HAVE_V4
+	vec_add = add_v4;
+	vec_mult = mult_v4;
+	vec_scale = scale_v4;
+	vec_sin = sin_v4;
+	vec_to_s16 = to_s16_v4;
+	vec_dot = dot_v4;
+	vec_run = run_v4;
+	vec_osc = osc_v4;
+#if defined (__x86_64__) || defined (__i386__)
+	vec_isa = "SSE2";
+#else
+	vec_isa = "NEON";
+#endif
+#endif
+
+#ifdef HAVE_V8
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports ("avx2"))
+	{
+		vec_add = add_v8;
+		vec_mult = mult_v8;
+		vec_scale = scale_v8;
+		vec_sin = sin_v8;
+		vec_to_s16 = to_s16_v8;
+		vec_dot = dot_v8;
+		vec_run = run_v8;
+		vec_osc = osc_v8;
+		vec_isa = "AVX2";
+	}
+#endif
+}
@@ -0,0 +1,58 @@
+/*
+**    This file is part of Stacy, the algebraic audio workstation.
+**    Copyright (C) 2013-2014 Mikael Bouillot
+**
+**    Stacy is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Stacy is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with Stacy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Vector kernels for the audio components.
+// vec_init() picks the widest implementation the CPU supports.
+
+void vec_init (void);
+
+extern const char *vec_isa;
+
+extern void (*vec_add) (float *dst, const float *a, const float *b, int n);
+extern void (*vec_mult) (float *dst, const float *a, const float *b, int n);
+extern void (*vec_scale) (float *dst, const float *a, float k, int n);
+extern void (*vec_sin) (float *dst, const float *a, int n);
+extern void (*vec_to_s16) (signed short *dst, const float *a, float gain, int n);
+extern float (*vec_dot) (const float *a, const float *b, int n);
+
+// Elementwise programs: postfix code run over n samples, VEC_BLOCK of them
+// at a time, with the intermediate values in a small scratch area instead
+// of whole buffers. VEC_LOAD pushes src[arg], the others work on the top of
+// the stack, and dst gets what's left. Each operation gives the same
+// samples as the kernel of the same name above.
+
+enum { VEC_LOAD, VEC_SCALE, VEC_SIN, VEC_ADD, VEC_MULT };
+
+#define VEC_STACK 8
+#define VEC_BLOCK 64
+
+typedef struct
+{
+	int op;
+	int arg;	// VEC_LOAD: source
+	float k;	// VEC_SCALE: factor
+} vec_insn;
+
+extern void (*vec_run) (float *dst, const vec_insn *code, int len, float *const *src, int n);
+
+// Oscillator bank: adds 'voices' oscillators to out[0..n-1]. Phases are in
+// cycles, in [0, 1), and advance by freq[v] * inc[i] at sample i.
+
+enum { OSC_SINE, OSC_SQUARE, OSC_SAWTOOTH };
+
+extern void (*vec_osc) (float *out, float *phase, const float *freq, int voices, const float *inc, int n, int wave);
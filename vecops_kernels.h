@@ -0,0 +1,295 @@
+/*
+**    This file is part of Stacy, the algebraic audio workstation.
+**    Copyright (C) 2013-2014 Mikael Bouillot
+**
+**    Stacy is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Stacy is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with Stacy.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Kernel template, included by vecops.c once per vector width.
+// Expects VEC_WIDTH (in floats), VEC_NAME(f) and VEC_TARGET to be defined.
+//
+// The arithmetic is the same as in the scalar versions, operation for
+// operation, so that every implementation gives the same samples. The only
+// exceptions are the oscillator bank, which sums its voices in another order,
+// and the dot product, which sums lane by lane.
+
+typedef float VEC_NAME(vf) __attribute__ ((vector_size (VEC_WIDTH * 4)));
+typedef int VEC_NAME(vi) __attribute__ ((vector_size (VEC_WIDTH * 4)));
+typedef short VEC_NAME(vs) __attribute__ ((vector_size (VEC_WIDTH * 2)));
+
+#define vf VEC_NAME(vf)
+#define vi VEC_NAME(vi)
+#define vs VEC_NAME(vs)
+
+// Lanes of a where m is set, of b elsewhere
+#define vsel(m,a,b) ((vf) (((m) & (vi) (a)) | (~(m) & (vi) (b))))
+
+static VEC_TARGET void VEC_NAME(add) (float *dst, const float *a, const float *b, int n)
+{
+	vf x, y;
+	int i;
+
+	for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH)
+	{
+		memcpy (&x, a + i, sizeof (vf));
+		memcpy (&y, b + i, sizeof (vf));
+		x = x + y;
+		memcpy (dst + i, &x, sizeof (vf));
+	}
+
+	add_c (dst + i, a + i, b + i, n - i);
+}
+
+static VEC_TARGET void VEC_NAME(mult) (float *dst, const float *a, const float *b, int n)
+{
+	vf x, y;
+	int i;
+
+	for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH)
+	{
+		memcpy (&x, a + i, sizeof (vf));
+		memcpy (&y, b + i, sizeof (vf));
+		x = x * y;
+		memcpy (dst + i, &x, sizeof (vf));
+	}
+
+	mult_c (dst + i, a + i, b + i, n - i);
+}
+
+static VEC_TARGET void VEC_NAME(scale) (float *dst, const float *a, float k, int n)
+{
+	vf x;
+	int i;
+
+	for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH)
+	{
+		memcpy (&x, a + i, sizeof (vf));
+		x = x * k;
+		memcpy (dst + i, &x, sizeof (vf));
+	}
+
+	scale_c (dst + i, a + i, k, n - i);
+}
+
+static inline VEC_TARGET vf VEC_NAME(sin_lanes) (vf x)
+{
+	vf q, r, r2, p;
+	vi qi;
+
+	// x = q * pi + r, with r in [-pi/2, pi/2]
+	q = x * SIN_INV_PI;
+	qi = __builtin_convertvector (q + 0.5f + __builtin_convertvector (q < 0.0f, vf), vi);
+	q = __builtin_convertvector (qi, vf);
+	r = (x - q * SIN_PI_A) - q * SIN_PI_B;
+
+	r2 = r * r;
+	p = r * (SIN_C1 + r2 * (SIN_C3 + r2 * (SIN_C5 + r2 * (SIN_C7 + r2 * SIN_C9))));
+
+	// sin (q * pi + r) = (-1)^q * sin (r)
+	return p * (1.0f - 2.0f * __builtin_convertvector (qi & 1, vf));
+}
+
+static VEC_TARGET void VEC_NAME(sin) (float *dst, const float *a, int n)
+{
+	vf x;
+	int i;
+
+	for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH)
+	{
+		memcpy (&x, a + i, sizeof (vf));
+		x = VEC_NAME(sin_lanes) (x);
+		memcpy (dst + i, &x, sizeof (vf));
+	}
+
+	sin_c (dst + i, a + i, n - i);
+}
+
+static VEC_TARGET void VEC_NAME(to_s16) (signed short *dst, const float *a, float gain, int n)
+{
+	vf x;
+	vs s;
+	int i;
+
+	for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH)
+	{
+		memcpy (&x, a + i, sizeof (vf));
+
+		x = x * gain;
+		x = vsel (x < -1.0f, (vf) {} - 1.0f, x);
+		x = vsel (x > 1.0f, (vf) {} + 1.0f, x);
+
+		s = __builtin_convertvector (__builtin_convertvector (x * 32767.0f, vi), vs);
+		memcpy (dst + i, &s, sizeof (vs));
+	}
+
+	to_s16_c (dst + i, a + i, gain, n - i);
+}
+
+static VEC_TARGET float VEC_NAME(dot) (const float *a, const float *b, int n)
+{
+	vf x, y, acc;
+	float sum;
+	int i, l;
+
+	acc = (vf) {};
+	for (i = 0; i + VEC_WIDTH <= n; i += VEC_WIDTH)
+	{
+		memcpy (&x, a + i, sizeof (vf));
+		memcpy (&y, b + i, sizeof (vf));
+		acc = acc + x * y;
+	}
+
+	sum = dot_c (a + i, b + i, n - i);
+	for (l = 0; l < VEC_WIDTH; l++)
+		sum += acc[l];
+
+	return sum;
+}
+
+// A block of samples at a time, each instruction being one of the kernels
+// above on a scratch buffer that stays in the cache. The last one writes
+// to dst directly.
+static VEC_TARGET void VEC_NAME(run) (float *dst, const vec_insn *code, int len, float *const *src, int n)
+{
+	float scratch[VEC_STACK][VEC_BLOCK];
+	const float *st[VEC_STACK];
+	float *out;
+	int i, j, m, sp;
+
+	for (i = 0; i < n; i += VEC_BLOCK)
+	{
+		m = n - i < VEC_BLOCK ? n - i : VEC_BLOCK;
+		sp = 0;
+
+		for (j = 0; j < len; j++)
+		{
+			if (code[j].op == VEC_LOAD)
+			{
+				st[sp++] = src[code[j].arg] + i;
+				continue;
+			}
+
+			if (code[j].op == VEC_ADD || code[j].op == VEC_MULT)
+				sp--;
+			out = j == len - 1 ? dst + i : scratch[sp-1];
+
+			switch (code[j].op)
+			{
+				case VEC_SCALE:
+					VEC_NAME(scale) (out, st[sp-1], code[j].k, m);
+					break;
+				case VEC_SIN:
+					VEC_NAME(sin) (out, st[sp-1], m);
+					break;
+				case VEC_ADD:
+					VEC_NAME(add) (out, st[sp-1], st[sp], m);
+					break;
+				case VEC_MULT:
+					VEC_NAME(mult) (out, st[sp-1], st[sp], m);
+					break;
+			}
+
+			st[sp-1] = out;
+		}
+	}
+}
+
+// Lane indices picking the even or the odd lanes of two vectors laid end to end
+#if VEC_WIDTH == 4
+#define VEC_EVEN ((vi) {0, 2, 4, 6})
+#define VEC_ODD ((vi) {1, 3, 5, 7})
+#else
+#define VEC_EVEN ((vi) {0, 2, 4, 6, 8, 10, 12, 14})
+#define VEC_ODD ((vi) {1, 3, 5, 7, 9, 11, 13, 15})
+#endif
+
+// One voice per lane. Each sample's lanes pile up in acc[] over all the
+// voices of a block, and get summed once at the end, VEC_WIDTH samples at a
+// time: every round adds neighbouring lanes of two rows, halving their number
+// until one vector holds the totals of VEC_WIDTH consecutive samples.
+static VEC_TARGET void VEC_NAME(osc) (float *out, float *phase, const float *freq, int voices, const float *inc, int n, int wave)
+{
+	vf acc[VEC_BLOCK], x[VEC_WIDTH], p, f, w;
+	int v, i, b, m, k, rows, whole;
+	float sum;
+	vi mask;
+
+	whole = voices - voices % VEC_WIDTH;
+
+	for (b = 0; whole && b < n; b += VEC_BLOCK)
+	{
+		m = n - b < VEC_BLOCK ? n - b : VEC_BLOCK;
+		memset (acc, 0, m * sizeof (vf));
+
+		for (v = 0; v < whole; v += VEC_WIDTH)
+		{
+			memcpy (&p, phase + v, sizeof (vf));
+			memcpy (&f, freq + v, sizeof (vf));
+
+			for (i = 0; i < m; i++)
+			{
+				switch (wave)
+				{
+					case OSC_SINE:
+						w = VEC_NAME(sin_lanes) (p * (float) (2 * M_PI));
+						break;
+					case OSC_SQUARE:
+						mask = (p > 0.0f) & (p < 0.5f);
+						w = vsel (mask, (vf) {} + 1.0f, (vf) {} - 1.0f);
+						break;
+					default:
+						w = p * 2.0f - 1.0f;
+						break;
+				}
+
+				acc[i] += w;
+
+				p = p + f * inc[b + i];
+				p = p - __builtin_convertvector (__builtin_convertvector (p, vi), vf);
+			}
+
+			memcpy (phase + v, &p, sizeof (vf));
+		}
+
+		for (i = 0; i + VEC_WIDTH <= m; i += VEC_WIDTH)
+		{
+			memcpy (x, acc + i, sizeof (x));
+			for (rows = VEC_WIDTH; rows > 1; rows /= 2)
+				for (k = 0; k < rows / 2; k++)
+					x[k] = __builtin_shuffle (x[2*k], x[2*k+1], VEC_EVEN)
+						+ __builtin_shuffle (x[2*k], x[2*k+1], VEC_ODD);
+
+			memcpy (&w, out + b + i, sizeof (vf));
+			w = w + x[0];
+			memcpy (out + b + i, &w, sizeof (vf));
+		}
+
+		for (; i < m; i++)
+		{
+			sum = 0;
+			for (k = 0; k < VEC_WIDTH; k++)
+				sum += acc[i][k];
+			out[b + i] += sum;
+		}
+	}
+
+	osc_c (out, phase + whole, freq + whole, voices - whole, inc, n, wave);
+}
+
+#undef VEC_EVEN
+#undef VEC_ODD
+#undef vsel
+#undef vf
+#undef vi
+#undef vs